@@ -3,6 +3,8 @@
 int main(int argc, char** argv /*, char** envp*/)
 {
     rebuild_self(__FILE__, argc, argv, {"nobcpp.hpp"});
+    // Hands the invocation to `./nobcpp serve` when one is running
+    forward_to_daemon(argc, argv);
     std::cout << __TIME__ << std::endl;
 
     // for (char** env = envp; *env != nullptr; ++env)
@@ -15,10 +17,13 @@ int main(int argc, char** argv /*, char** envp*/)
         {"debug", {{"-O0", "-g"}}},
     };
 
-    auto tree_2 = build_tree_from_cpp_files("src/project_2/", "build/project_2/target.a");
+    // Both projects are walked in one parallel pass
+    auto trees =
+        build_trees_from_cpp_files({{"src/project_2/", "build/project_2/target.a"},
+                                    {"src/project_1/", "build/project_1/target"}});
+    auto tree_2 = std::move(trees[0]);
 
-    const auto tree_1 =
-        build_tree_from_cpp_files("src/project_1/", "build/project_1/target");
+    const auto tree_1 = std::move(trees[1]);
 
     tree_1->add_dep(std::move(tree_2));
 
@@ -1,23 +1,48 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <linux/io_uring.h>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <poll.h>
 #include <queue>
 #include <set>
+#include <spawn.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -107,127 +132,683 @@ inline std::ostream& operator<<(std::ostream& os, const Timer& timer)
     return os;
 }
 
+// 64-bit FNV-1a, chainable through the seed
+inline uint64_t hash_string(std::string_view string,
+                            uint64_t seed = 14695981039346656037ull)
+{
+    for (unsigned char c : string)
+    {
+        seed = (seed ^ c) * 1099511628211ull;
+    }
+    return seed;
+}
+
+inline std::string json_escape(std::string_view string)
+{
+    std::string escaped;
+    escaped.reserve(string.size());
+    for (char c : string)
+    {
+        switch (c)
+        {
+        case '"':
+            escaped += "\\\"";
+            break;
+        case '\\':
+            escaped += "\\\\";
+            break;
+        case '\n':
+            escaped += "\\n";
+            break;
+        case '\t':
+            escaped += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
+}
+
 // ----------------------------------------------------------------------------------
-// Rebuild
+// Processes
 // ----------------------------------------------------------------------------------
 
+// What wait4 reports about a finished child
+struct ResourceUsage
+{
+    std::chrono::microseconds user_time{0};
+    std::chrono::microseconds system_time{0};
+    long max_rss_kb = 0;
+    long blocks_in = 0;
+    long blocks_out = 0;
+};
+
 struct ProcessResult
 {
     std::string out;
     std::string err;
     int exit_code;
+    ResourceUsage usage = {};
 };
 
-inline ProcessResult run_process(const std::string& cmd,
-                                 const std::vector<std::string>& args)
+// Flattens an argument list into one contiguous NUL-separated buffer plus the
+// pointer array exec expects, so spawning from it needs no further allocation.
+class ArgvArena
 {
-    int out_pipe[2], err_pipe[2];
-    if (pipe(out_pipe) == -1 || pipe(err_pipe) == -1)
+  public:
+    explicit ArgvArena(const std::vector<std::string>& strings);
+    ArgvArena(const ArgvArena&) = delete;
+    ArgvArena& operator=(const ArgvArena&) = delete;
+
+    char* const* data() const;
+
+  private:
+    std::string storage;
+    std::vector<char*> pointers;
+};
+
+inline ArgvArena::ArgvArena(const std::vector<std::string>& strings)
+{
+    size_t size = 0;
+    for (const auto& string : strings)
+    {
+        size += string.size() + 1;
+    }
+    storage.reserve(size);
+    for (const auto& string : strings)
     {
-        perror("pipe");
-        return {"", "", -1};
+        storage.append(string);
+        storage.push_back('\0');
     }
 
-    pid_t pid = fork();
-    if (pid == -1)
+    pointers.reserve(strings.size() + 1);
+    size_t offset = 0;
+    for (const auto& string : strings)
     {
-        perror("fork");
-        return {"", "", -1};
+        pointers.push_back(storage.data() + offset);
+        offset += string.size() + 1;
     }
+    pointers.push_back(nullptr);
+}
+
+inline char* const* ArgvArena::data() const
+{
+    return pointers.data();
+}
 
-    if (pid == 0)
+inline std::shared_ptr<const ArgvArena> make_argv(const std::string& cmd,
+                                                  const std::vector<std::string>& args)
+{
+    std::vector<std::string> argv;
+    argv.reserve(args.size() + 2);
+    argv.push_back(cmd);
+    argv.insert(argv.end(), args.begin(), args.end());
+    if (cmd == "gcc" || cmd == "g++" || cmd == "c++" || cmd == "clang" ||
+        cmd == "clang++")
     {
-        // Child
-        close(out_pipe[0]);
-        close(err_pipe[0]);
-        dup2(out_pipe[1], STDOUT_FILENO);
-        dup2(err_pipe[1], STDERR_FILENO);
-        close(out_pipe[1]);
-        close(err_pipe[1]);
-        const std::string enable_color_flag = "-fdiagnostics-color=always";
+        argv.push_back("-fdiagnostics-color=always");
+    }
+    return std::make_shared<const ArgvArena>(argv);
+}
 
-        // Build argv
-        std::vector<char*> argv;
-        argv.push_back(const_cast<char*>(cmd.c_str()));
-        for (const auto& arg : args)
-        {
-            argv.push_back(const_cast<char*>(arg.c_str()));
-        }
+// Children only get PATH from the parent environment, plus MAKEFLAGS when they
+// should join a jobserver
+inline std::unique_ptr<const ArgvArena>
+make_environment(const std::string& makeflags = "")
+{
+    const char* path = std::getenv("PATH");
+    std::vector<std::string> env{path ? std::string("PATH=") + path
+                                      : std::string("PATH=/usr/bin:/bin")};
+    if (!makeflags.empty())
+    {
+        env.push_back("MAKEFLAGS=" + makeflags);
+    }
+    return std::make_unique<const ArgvArena>(env);
+}
+
+inline const ArgvArena& spawn_environment()
+{
+    static const std::unique_ptr<const ArgvArena> envp = make_environment();
+    return *envp;
+}
+
+// Spawns child processes and multiplexes their stdout/stderr pipes and pidfds on a
+// single epoll instance, so any number of jobs can be driven from one thread.
+class ProcessReactor
+{
+  public:
+    struct Completion
+    {
+        int job;
+        ProcessResult result;
+    };
+
+    explicit ProcessReactor(const ArgvArena& envp = spawn_environment(),
+                            bool process_groups = false);
+    ~ProcessReactor();
+    ProcessReactor(const ProcessReactor&) = delete;
+    ProcessReactor& operator=(const ProcessReactor&) = delete;
+
+    void spawn(int job, const ArgvArena& argv);
+    size_t running() const;
+    std::vector<Completion> wait(int timeout_ms = -1);
+    void wake_on_readable(int fd);
+    void terminate(int signal);
+
+  private:
+    enum Source : uint64_t
+    {
+        OUT = 0,
+        ERR = 1,
+        PID = 2,
+        WAKE = 3
+    };
+
+    struct Child
+    {
+        pid_t pid;
+        int out_fd;
+        int err_fd;
+        int pid_fd;
+        std::string out;
+        std::string err;
+        std::optional<int> status;
+        ResourceUsage usage;
+    };
+
+    int epoll_fd;
+    const ArgvArena& envp;
+    bool process_groups;
+    std::unordered_map<int, Child> children;
+    std::vector<Completion> done;
+
+    void watch(int fd, int job, Source source);
+    void unwatch(int& fd);
+    void drain(int& fd, std::string& buffer);
+    void fail(int job, const char* what);
+    bool reap(Child& child, int options);
+};
+
+// With process_groups, every child leads a process group of its own. Terminal
+// signals then only reach the driver, and terminate() reaches the compiler's own
+// children (cc1plus, as, ld) too.
+inline ProcessReactor::ProcessReactor(const ArgvArena& envp, bool process_groups)
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), envp(envp), process_groups(process_groups)
+{
+    if (epoll_fd == -1)
+    {
+        throw std::runtime_error(std::string("epoll_create1: ") + std::strerror(errno));
+    }
+}
 
-        if (cmd == "gcc" || cmd == "g++" || cmd == "c++" || cmd == "clang" ||
-            cmd == "clang++")
+inline ProcessReactor::~ProcessReactor()
+{
+    for (auto& [job, child] : children)
+    {
+        unwatch(child.out_fd);
+        unwatch(child.err_fd);
+        unwatch(child.pid_fd);
+        if (!child.status)
         {
-            argv.push_back(const_cast<char*>(enable_color_flag.c_str()));
+            int status;
+            waitpid(child.pid, &status, 0);
         }
-        argv.push_back(nullptr);
+    }
+    close(epoll_fd);
+}
 
-        // Pass through PATH from parent
-        const char* path = std::getenv("PATH");
-        std::string path_var = path ? std::string("PATH=") + path : "PATH=/usr/bin:/bin";
-        char* envp[] = {const_cast<char*>(path_var.c_str()), nullptr};
+inline size_t ProcessReactor::running() const
+{
+    return children.size() + done.size();
+}
 
-        // Use execvpe to search PATH
-        execvpe(cmd.c_str(), argv.data(), envp);
+inline void ProcessReactor::watch(int fd, int job, Source source)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = (static_cast<uint64_t>(job) << 2) | source;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-        // If execvpe fails
-        perror("execvpe");
-        _exit(127);
+inline void ProcessReactor::unwatch(int& fd)
+{
+    if (fd != -1)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        fd = -1;
     }
-    else
+}
+
+inline void ProcessReactor::drain(int& fd, std::string& buffer)
+{
+    char chunk[4096];
+    ssize_t count = read(fd, chunk, sizeof(chunk));
+    if (count > 0)
+    {
+        buffer.append(chunk, count);
+    }
+    else if (count == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        unwatch(fd);
+    }
+}
+
+inline void ProcessReactor::fail(int job, const char* what)
+{
+    std::string message = std::string(what) + ": " + std::strerror(errno) + "\n";
+    done.push_back({job, {"", message, -1}});
+}
+
+inline bool ProcessReactor::reap(Child& child, int options)
+{
+    int status;
+    rusage usage;
+    if (wait4(child.pid, &status, options, &usage) != child.pid)
+    {
+        return false;
+    }
+    auto to_duration = [](const timeval& time) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::seconds(time.tv_sec) + std::chrono::microseconds(time.tv_usec));
+    };
+    child.status = status;
+    child.usage = {to_duration(usage.ru_utime), to_duration(usage.ru_stime),
+                   usage.ru_maxrss, usage.ru_inblock, usage.ru_oublock};
+    return true;
+}
+
+inline void ProcessReactor::spawn(int job, const ArgvArena& argv)
+{
+    // Close-on-exec keeps the pipes of one job from leaking into the other jobs'
+    // children; dup2 onto stdout/stderr clears the flag for the child's own ends
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) == -1)
+    {
+        fail(job, "pipe2");
+        return;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1)
     {
-        // Parent
+        fail(job, "pipe2");
+        close(out_pipe[0]);
         close(out_pipe[1]);
-        close(err_pipe[1]);
-        std::string out, err;
-        char buffer[4096];
-        ssize_t count;
-        fd_set fds;
-        int maxfd = std::max(out_pipe[0], err_pipe[0]);
-        bool out_open = true, err_open = true;
-
-        while (out_open || err_open)
-        {
-            FD_ZERO(&fds);
-            if (out_open)
-                FD_SET(out_pipe[0], &fds);
-            if (err_open)
-                FD_SET(err_pipe[0], &fds);
-
-            int ready = select(maxfd + 1, &fds, nullptr, nullptr, nullptr);
-            if (ready == -1)
-            {
-                perror("select");
+        return;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+
+    // Children start with no blocked signals, whatever the driver blocks to read them
+    // from a signalfd
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attributes, &no_signals);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (process_groups)
+    {
+        posix_spawnattr_setpgroup(&attributes, 0);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    // posix_spawnp uses vfork semantics, so the driver's page tables are never copied
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv.data()[0], &actions, &attributes, argv.data(),
+                             envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    if (error != 0)
+    {
+        errno = error;
+        fail(job, "posix_spawnp");
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return;
+    }
+
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(err_pipe[0], F_SETFL, O_NONBLOCK);
+
+    // Without pidfd support the child is reaped once both pipes are closed
+    int pid_fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+
+    children[job] = {pid, out_pipe[0], err_pipe[0], pid_fd, {}, {}, std::nullopt, {}};
+    watch(out_pipe[0], job, OUT);
+    watch(err_pipe[0], job, ERR);
+    if (pid_fd != -1)
+    {
+        watch(pid_fd, job, PID);
+    }
+}
+
+// Makes the next wait() return as soon as fd becomes readable, once
+inline void ProcessReactor::wake_on_readable(int fd)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = WAKE;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1 && errno == ENOENT)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Signals every child that has not exited yet, with its whole process group if it
+// leads one
+inline void ProcessReactor::terminate(int signal)
+{
+    for (const auto& [job, child] : children)
+    {
+        if (!child.status)
+        {
+            kill(process_groups ? -child.pid : child.pid, signal);
+        }
+    }
+}
+
+// Returns early with nothing once the timeout passes without a job finishing, or
+// when a wake_on_readable fd became readable
+inline std::vector<ProcessReactor::Completion> ProcessReactor::wait(int timeout_ms)
+{
+    std::array<epoll_event, 64> events;
+    while (done.empty() && !children.empty())
+    {
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("epoll_wait: ") + std::strerror(errno));
+        }
+        if (ready == 0)
+        {
+            break;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < ready; ++i)
+        {
+            if (events[i].data.u64 == WAKE)
+            {
+                woken = true;
+                continue;
+            }
+            int job = static_cast<int>(events[i].data.u64 >> 2);
+            auto it = children.find(job);
+            if (it == children.end())
+                continue;
+            Child& child = it->second;
+
+            switch (static_cast<Source>(events[i].data.u64 & 3))
+            {
+            case OUT:
+                drain(child.out_fd, child.out);
+                break;
+            case ERR:
+                drain(child.err_fd, child.err);
+                break;
+            case PID:
+                if (reap(child, WNOHANG))
+                {
+                    unwatch(child.pid_fd);
+                }
+                break;
+            case WAKE:
                 break;
             }
 
-            if (out_open && FD_ISSET(out_pipe[0], &fds))
+            if (child.out_fd != -1 || child.err_fd != -1 || child.pid_fd != -1)
+                continue;
+            if (!child.status)
             {
-                count = read(out_pipe[0], buffer, sizeof(buffer));
-                if (count > 0)
-                    out.append(buffer, count);
-                else
-                    out_open = false;
+                reap(child, 0);
             }
+            // Killed children report 128 + the signal, like in the shell
+            int exit_code = WIFEXITED(*child.status)     ? WEXITSTATUS(*child.status)
+                            : WIFSIGNALED(*child.status) ? 128 + WTERMSIG(*child.status)
+                                                         : -1;
+            done.push_back({job,
+                            {std::move(child.out), std::move(child.err), exit_code,
+                             child.usage}});
+            children.erase(it);
+        }
+        if (woken)
+        {
+            break;
+        }
+    }
+    return std::exchange(done, {});
+}
+
+inline ProcessResult run_process(const std::string& cmd,
+                                 const std::vector<std::string>& args)
+{
+    ProcessReactor reactor;
+    reactor.spawn(0, *make_argv(cmd, args));
+    return reactor.wait().front().result;
+}
+
+// ----------------------------------------------------------------------------------
+// Jobserver
+// ----------------------------------------------------------------------------------
+
+// Client of a GNU make jobserver inherited through MAKEFLAGS, in its named fifo
+// ("--jobserver-auth=fifo:PATH") or its pipe ("--jobserver-auth=R,W") form. Every
+// running job beyond the first needs one token read from it; the first job runs on
+// the token make implicitly granted this process.
+//
+// Without a parent jobserver, create() serves one of our own to the jobs, so that
+// -flto=jobserver links or nested makes draw from the same slots as the build.
+class JobServer
+{
+  public:
+    static std::unique_ptr<JobServer> from_environment();
+    static std::unique_ptr<JobServer> create(int slots);
+
+    JobServer(int read_fd, int write_fd, const std::string& makeflags);
+    ~JobServer();
+    JobServer(const JobServer&) = delete;
+    JobServer& operator=(const JobServer&) = delete;
+
+    int get_read_fd() const;
+    const std::string& get_makeflags() const;
+    bool is_owned() const;
+    bool try_acquire();
+    void release();
+
+  private:
+    int read_fd;
+    int write_fd;
+    std::string makeflags;
+    std::vector<char> tokens;
+    // Only set on a jobserver made by create()
+    std::filesystem::path fifo_dir;
+    int child_fd = -1;
+};
+
+inline std::unique_ptr<JobServer> JobServer::from_environment()
+{
+    const char* makeflags = std::getenv("MAKEFLAGS");
+    if (!makeflags)
+    {
+        return nullptr;
+    }
 
-            if (err_open && FD_ISSET(err_pipe[0], &fds))
+    // The last occurrence wins, like in make
+    std::string auth;
+    std::istringstream words(makeflags);
+    std::string word;
+    while (words >> word)
+    {
+        for (const char* prefix : {"--jobserver-auth=", "--jobserver-fds="})
+        {
+            if (word.starts_with(prefix))
             {
-                count = read(err_pipe[0], buffer, sizeof(buffer));
-                if (count > 0)
-                    err.append(buffer, count);
-                else
-                    err_open = false;
+                auth = word.substr(std::strlen(prefix));
             }
         }
+    }
+    if (auth.empty())
+    {
+        return nullptr;
+    }
 
-        close(out_pipe[0]);
-        close(err_pipe[0]);
-        int status;
-        waitpid(pid, &status, 0);
-        int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
-        return {out, err, exit_code};
+    if (auth.starts_with("fifo:"))
+    {
+        const std::string fifo = auth.substr(5);
+        int fd = open(fifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1)
+        {
+            std::cerr << "Cannot open jobserver fifo " << fifo << ": "
+                      << std::strerror(errno) << "\n";
+            return nullptr;
+        }
+        return std::make_unique<JobServer>(fd, fd, makeflags);
     }
+
+    int read_end = -1, write_end = -1;
+    if (std::sscanf(auth.c_str(), "%d,%d", &read_end, &write_end) != 2 || read_end < 0 ||
+        write_end < 0 || fcntl(read_end, F_GETFD) == -1 ||
+        fcntl(write_end, F_GETFD) == -1)
+    {
+        std::cerr << "Jobserver " << auth << " not inherited, is the rule missing '+'?\n";
+        return nullptr;
+    }
+    // Reopening gives a private file description, so making it non-blocking does not
+    // affect make or the other clients sharing the pipe
+    const std::string reopened = "/proc/self/fd/" + std::to_string(read_end);
+    int fd = open(reopened.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        std::cerr << "Cannot reopen jobserver pipe: " << std::strerror(errno) << "\n";
+        return nullptr;
+    }
+    return std::make_unique<JobServer>(fd, write_end, makeflags);
+}
+
+// The pool is a fifo holding slots - 1 tokens. Children get it in the R,W form on an
+// inherited, blocking descriptor of their own, which make 4.x and GCC's lto-wrapper
+// both understand; nobcpp reads through a separate non-blocking open.
+inline std::unique_ptr<JobServer> JobServer::create(int slots)
+{
+    char dir_template[] = "/tmp/nobcpp-jobserver-XXXXXX";
+    if (!mkdtemp(dir_template))
+    {
+        perror("mkdtemp");
+        return nullptr;
+    }
+    const std::filesystem::path dir = dir_template;
+    const std::string fifo = (dir / "fifo").string();
+    int fd = -1, child_fd = -1;
+    if (mkfifo(fifo.c_str(), 0600) == -1 ||
+        (fd = open(fifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1 ||
+        (child_fd = open(fifo.c_str(), O_RDWR)) == -1)
+    {
+        perror("jobserver fifo");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+        return nullptr;
+    }
+
+    const std::string tokens(std::max(slots - 1, 0), '+');
+    if (!tokens.empty() && write(fd, tokens.data(), tokens.size()) == -1)
+    {
+        perror("jobserver fifo");
+    }
+
+    std::string makeflags = " -j" + std::to_string(slots) + " --jobserver-auth=" +
+                            std::to_string(child_fd) + "," + std::to_string(child_fd);
+    auto jobserver = std::make_unique<JobServer>(fd, fd, makeflags);
+    jobserver->fifo_dir = dir;
+    jobserver->child_fd = child_fd;
+    return jobserver;
+}
+
+inline JobServer::JobServer(int read_fd, int write_fd, const std::string& makeflags)
+    : read_fd(read_fd), write_fd(write_fd), makeflags(makeflags)
+{
+}
+
+// Tokens still held go back, or the parent's pool would shrink for good
+inline JobServer::~JobServer()
+{
+    while (!tokens.empty())
+    {
+        release();
+    }
+    close(read_fd);
+    if (is_owned())
+    {
+        close(child_fd);
+        std::error_code ec;
+        std::filesystem::remove_all(fifo_dir, ec);
+    }
+}
+
+inline int JobServer::get_read_fd() const
+{
+    return read_fd;
+}
+
+inline const std::string& JobServer::get_makeflags() const
+{
+    return makeflags;
+}
+
+inline bool JobServer::is_owned() const
+{
+    return child_fd != -1;
+}
+
+inline bool JobServer::try_acquire()
+{
+    char token;
+    if (read(read_fd, &token, 1) != 1)
+    {
+        return false;
+    }
+    tokens.push_back(token);
+    return true;
+}
+
+inline void JobServer::release()
+{
+    if (tokens.empty())
+    {
+        return;
+    }
+    while (write(write_fd, &tokens.back(), 1) == -1 && errno == EINTR)
+    {
+    }
+    tokens.pop_back();
 }
 
+// ----------------------------------------------------------------------------------
+// Rebuild
+// ----------------------------------------------------------------------------------
+
 inline void rebuild_self(const std::string& source_filename, int argc, char** argv,
                          const std::vector<std::string>& deps = {})
 {
@@ -277,953 +858,4559 @@ inline void rebuild_self(const std::string& source_filename, int argc, char** ar
 }
 
 // ----------------------------------------------------------------------------------
-// Type definitions
+// Build log
 // ----------------------------------------------------------------------------------
 
-enum class TargetType
+// Per-output record of the last successful run, persisted across invocations as
+// one "<command hash> <duration us> <peak rss kb> <output>" line per output.
+class BuildLog
 {
-    EXECUTABLE,
-    STATIC_LIB,
-    DYNAMIC_LIB,
-    OBJECT,
-    NONE
-};
+  public:
+    struct Entry
+    {
+        uint64_t command_hash;
+        uint64_t duration_us;
+        uint64_t max_rss_kb;
+        // The last run failed; such jobs are never up to date and are started first
+        bool failed = false;
+    };
 
-class CompileCommand
-{
-  private:
-    std::string command;
-    std::vector<std::string> args;
-    bool enabled;
-    bool compile;
+    explicit BuildLog(const std::filesystem::path& path = "build/.nobcpp_log");
 
-  public:
-    CompileCommand(const std::string& command, const std::vector<std::string> args,
-                   bool enabled, bool compile);
-    bool is_enabled() const;
-    bool is_compile() const;
-    int execute() const;
-    const std::string get_abs_file() const;
-    void print(std::ostream& os) const;
-    friend std::ostream& operator<<(std::ostream& os, const CompileCommand& cc);
-};
+    const Entry* find(const std::string& output) const;
+    void record(const std::string& output, const Entry& entry);
+    void save() const;
 
-class CompileCommands
-{
   private:
-    std::vector<CompileCommand> cmds;
-    std::vector<std::vector<int>> outs;
-    std::vector<int> in_degree;
+    // The last log read or written, reused while the file is unchanged, so a daemon's
+    // requests and repeated builds of one process do not parse it again
+    struct Snapshot
+    {
+        std::filesystem::path path;
+        struct stat identity;
+        std::unordered_map<std::string, Entry> entries;
+    };
+    static std::optional<Snapshot>& snapshot();
+    static bool same_file(const struct stat& a, const struct stat& b);
 
-  public:
-    int add_cmd(const CompileCommand& compile_command);
-    bool add_edge(int src, int dst);
-    void execute(int max_parallel = 0) const;
-    void write() const;
-    friend std::ostream& operator<<(std::ostream& os, CompileCommands compile_commands);
+    std::filesystem::path path;
+    std::unordered_map<std::string, Entry> entries;
+    bool dirty = false;
 };
 
-inline CompileCommand::CompileCommand(const std::string& command,
-                                      const std::vector<std::string> args, bool enabled,
-                                      bool compile)
-    : command(command), args(args), enabled(enabled), compile(compile)
+// Version 2 logs start with a header line and carry a failure flag after the peak
+// RSS; version 1 logs have neither
+inline constexpr std::string_view build_log_header = "# nobcpp log v2";
+
+inline std::optional<BuildLog::Snapshot>& BuildLog::snapshot()
 {
+    static std::optional<Snapshot> last;
+    return last;
 }
 
-class Profile
+inline bool BuildLog::same_file(const struct stat& a, const struct stat& b)
 {
-  private:
-    std::vector<std::string> compile_flags;
-    std::vector<std::string> link_flags;
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
 
-  public:
-    Profile(const std::vector<std::string>& compile_flags = {},
-            const std::vector<std::string>& link_flags = {})
-        : compile_flags(compile_flags), link_flags(link_flags)
+inline BuildLog::BuildLog(const std::filesystem::path& path) : path(path)
+{
+    struct stat identity;
+    const bool exists = stat(path.c_str(), &identity) == 0;
+    std::optional<Snapshot>& last = snapshot();
+    if (exists && last && last->path == path && same_file(last->identity, identity))
     {
+        entries = last->entries;
+        return;
     }
 
-    const std::vector<std::string>& get_compile_flags() const
+    std::ifstream file(path);
+    std::string line;
+    bool has_failed_flag = false;
+    while (std::getline(file, line))
     {
-        return compile_flags;
+        if (line == build_log_header)
+        {
+            has_failed_flag = true;
+            continue;
+        }
+        std::istringstream fields(line);
+        Entry entry;
+        std::string output;
+        if (fields >> std::hex >> entry.command_hash >> std::dec >> entry.duration_us >>
+                entry.max_rss_kb &&
+            (!has_failed_flag || fields >> entry.failed) && fields.get() == ' ' &&
+            std::getline(fields, output))
+        {
+            entries[output] = entry;
+        }
+    }
+    if (exists)
+    {
+        last = Snapshot{path, identity, entries};
     }
+}
 
-    const std::vector<std::string>& get_link_flags() const
+inline const BuildLog::Entry* BuildLog::find(const std::string& output) const
+{
+    auto it = entries.find(output);
+    return it == entries.end() ? nullptr : &it->second;
+}
+
+inline void BuildLog::record(const std::string& output, const Entry& entry)
+{
+    entries[output] = entry;
+    dirty = true;
+}
+
+inline void BuildLog::save() const
+{
+    if (!dirty)
     {
-        return link_flags;
+        return;
     }
-};
+    std::filesystem::create_directories(path.parent_path());
+    const std::filesystem::path temp_path = path.string() + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::trunc);
+        file << build_log_header << '\n';
+        for (const auto& [output, entry] : entries)
+        {
+            file << std::hex << entry.command_hash << std::dec << ' ' << entry.duration_us
+                 << ' ' << entry.max_rss_kb << ' ' << entry.failed << ' ' << output
+                 << '\n';
+        }
+    }
+    std::filesystem::rename(temp_path, path);
+    struct stat identity;
+    if (stat(path.c_str(), &identity) == 0)
+    {
+        snapshot() = Snapshot{path, identity, entries};
+    }
+}
 
-class Unit
+// ----------------------------------------------------------------------------------
+// Build trace
+// ----------------------------------------------------------------------------------
+
+// Every job of one execution as Chrome trace events, one track per job slot, so
+// the build can be inspected in Perfetto or chrome://tracing
+class BuildTrace
 {
+  public:
+    struct Event
+    {
+        std::string name;
+        std::string category;
+        std::string command;
+        int slot;
+        std::chrono::microseconds start;
+        std::chrono::microseconds end;
+        int exit_code;
+    };
+
+    void add(Event event);
+    void write(const std::filesystem::path& path = "build/trace.json") const;
+
   private:
-    std::vector<std::unique_ptr<Unit>> deps;
-    std::optional<std::string> source_path;
-    std::optional<std::string> target_path;
-    std::optional<std::string> root_path;
-    std::vector<std::string> compile_flags;
-    std::vector<std::string> link_flags;
-    std::set<std::string> active_profiles;
-    TargetType target_type;
-    std::string compiler;
-    mutable std::optional<int> node_id;
+    std::vector<Event> events;
+};
 
-    void print_depth_impl(int depth) const;
+inline void BuildTrace::add(Event event)
+{
+    events.push_back(std::move(event));
+}
 
-    bool compile_impl(CompileCommands& compile_commands, TargetType target_type_parent,
-                      const bool full_rebuild,
-                      const std::vector<std::string>& inherited_compile_flags) const;
-    void clean_impl(CompileCommands& compile_commands) const;
-    void apply_profile(const std::string& name, const Profile& profile);
+inline void BuildTrace::write(const std::filesystem::path& path) const
+{
+    if (events.empty())
+    {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream out_file(path, std::ios::trunc);
+    if (!out_file)
+    {
+        std::cerr << "Could not open " << path << "!" << std::endl;
+        return;
+    }
+
+    out_file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out_file << "\t{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+                "\"args\": {\"name\": \"nobcpp\"}}";
+    for (const auto& event : events)
+    {
+        out_file << ",\n\t{\"name\": \"" << json_escape(event.name) << "\", \"cat\": \""
+                 << event.category << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": "
+                 << event.slot << ", \"ts\": " << event.start.count()
+                 << ", \"dur\": " << (event.end - event.start).count()
+                 << ", \"args\": {\"command\": \"" << json_escape(event.command)
+                 << "\", \"exit_code\": " << event.exit_code << "}}";
+    }
+    out_file << "\n]}\n";
+}
+
+// ----------------------------------------------------------------------------------
+// Pressure stall information
+// ----------------------------------------------------------------------------------
+
+// "some avg10" of /proc/pressure/<resource>: the share of the last ten seconds in
+// which at least one task stalled waiting for the resource
+inline std::optional<double> pressure_avg10(const std::string& resource)
+{
+    std::ifstream file("/proc/pressure/" + resource);
+    std::string kind, avg10;
+    if (!(file >> kind >> avg10) || kind != "some" || !avg10.starts_with("avg10="))
+    {
+        return std::nullopt;
+    }
+    return std::strtod(avg10.c_str() + 6, nullptr);
+}
 
+// Additive increase, multiplicative decrease of the job limit between 1 and
+// max_limit: halve under memory pressure, step down under CPU pressure and step
+// up again while the host has headroom and the limit is actually in use
+class PressureGovernor
+{
   public:
-    Unit(const std::optional<std::string>& source_path,
-         const std::optional<std::string>& target_path = std::nullopt,
-         const std::optional<std::string>& root_path = std::nullopt);
+    explicit PressureGovernor(int max_limit);
 
-    void add_dep(std::unique_ptr<Unit> unit);
-    void add_link_flag(const std::string& flag);
-    void add_link_flags(const std::vector<std::string>& flags);
-    void add_compile_flag(const std::string& flag);
-    void add_compile_flags(const std::vector<std::string>& flags);
-    void print_depth();
-    void set_compiler(const std::string& compiler);
-    CompileCommands compile(bool rebuild) const;
-    CompileCommands clean(bool remove_dir) const;
-    std::string get_target() const;
-    void parse(int argc, char** argv,
-               const std::unordered_map<std::string, Profile>& profiles = {});
-    friend std::ostream& operator<<(std::ostream& os, const Unit& unit);
+    bool available() const;
+    int get_limit() const;
+    void update(int running);
+
+  private:
+    static constexpr double memory_threshold = 10.0;
+    static constexpr double cpu_threshold = 50.0;
+    static constexpr std::chrono::milliseconds interval{1000};
+
+    int max_limit;
+    int limit;
+    bool psi;
+    std::chrono::steady_clock::time_point last_update;
 };
 
+inline PressureGovernor::PressureGovernor(int max_limit)
+    : max_limit(max_limit), limit(max_limit),
+      psi(pressure_avg10("cpu").has_value() && pressure_avg10("memory").has_value()),
+      last_update(std::chrono::steady_clock::now())
+{
+}
+
+inline bool PressureGovernor::available() const
+{
+    return psi;
+}
+
+inline int PressureGovernor::get_limit() const
+{
+    return limit;
+}
+
+inline void PressureGovernor::update(int running)
+{
+    const auto now = std::chrono::steady_clock::now();
+    if (!psi || now - last_update < interval)
+    {
+        return;
+    }
+    last_update = now;
+
+    const double memory = pressure_avg10("memory").value_or(0.0);
+    const double cpu = pressure_avg10("cpu").value_or(0.0);
+    const int previous = limit;
+    if (memory > memory_threshold)
+    {
+        limit = std::max(1, limit / 2);
+    }
+    else if (cpu > cpu_threshold)
+    {
+        limit = std::max(1, limit - 1);
+    }
+    else if (running >= limit)
+    {
+        limit = std::min(max_limit, limit + 1);
+    }
+
+    if (limit != previous)
+    {
+        std::cout << "Parallelism " << previous << " -> " << limit << " (memory "
+                  << memory << "%, cpu " << cpu << "%)" << std::endl;
+    }
+}
+
 // ----------------------------------------------------------------------------------
-// Parse command line args
+// Batch stat
 // ----------------------------------------------------------------------------------
 
-using CmdCommand = std::function<void(const Unit*)>;
-static std::unordered_map<std::string, CmdCommand> commands = {
-    {"build",
-     [](const Unit* unit) {
-         std::cout << "build" << std::endl;
-         CompileCommands cc = unit->compile(false);
-         cc.execute();
-         cc.write();
-     }},
-    {"clean",
-     [](const Unit* unit) {
-         std::cout << "clean" << std::endl;
-         CompileCommands cc = unit->clean(false);
-         std::cout << cc << std::endl;
-         cc.execute();
-     }},
-    {"cleanall",
-     [](const Unit* unit) {
-         std::cout << "clean all" << std::endl;
-         CompileCommands cc = unit->clean(true);
-         std::cout << cc << std::endl;
-         cc.execute();
-     }},
-    {"run",
-     [](const Unit* unit) {
-         std::cout << "run" << std::endl;
-         auto [output, error_output, exit_code] = run_process(unit->get_target(), {});
-         std::system(unit->get_target().c_str());
-     }},
-    {"rebuild", [](const Unit* unit) {
-         std::cout << "rebuild" << std::endl;
-         CompileCommands cc = unit->compile(true);
-         std::cout << cc << std::endl;
-         cc.execute();
-         cc.write();
-     }}};
+// Minimal io_uring instance that only submits IORING_OP_STATX. All the stat calls of
+// a dirty check are in flight at once instead of paying one round trip each, which
+// is what a no-op build spends its time on over NFS.
+class StatxRing
+{
+  public:
+    explicit StatxRing(unsigned entries = 256);
+    ~StatxRing();
+    StatxRing(const StatxRing&) = delete;
+    StatxRing& operator=(const StatxRing&) = delete;
 
-inline void Unit::parse(int argc, char** argv,
-                        const std::unordered_map<std::string, Profile>& profiles)
+    bool valid() const;
+    bool stat(const std::vector<const char*>& paths, std::vector<struct statx>& buffers,
+              std::vector<int>& results);
+
+  private:
+    int fd = -1;
+    unsigned entries = 0;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    size_t sqes_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
+
+// Kernels or sandboxes without io_uring leave the ring invalid
+inline StatxRing::StatxRing(unsigned entries)
 {
-    std::vector<std::string> cmd_flags;
-    cmd_flags.reserve(argc - 1);
+    io_uring_params params{};
+    fd = static_cast<int>(syscall(SYS_io_uring_setup, entries, &params));
+    if (fd == -1)
+    {
+        return;
+    }
+    this->entries = params.sq_entries;
 
-    bool nob_rebuild_present = false;
-    bool rebuild_present = false;
-    for (int i = 1; i < argc; i++)
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
     {
-        std::string arg = argv[i];
-        if (arg == "nob_rebuild")
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring
+                          : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    char* sq = static_cast<char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+inline StatxRing::~StatxRing()
+{
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+inline bool StatxRing::valid() const
+{
+    return fd != -1;
+}
+
+// statx(2) of every path into buffers, with the results as 0 or -errno. Keeps up to
+// one ring of requests in flight. Returns false when the ring or the kernel's
+// IORING_OP_STATX support fails, so the caller can fall back.
+inline bool StatxRing::stat(const std::vector<const char*>& paths,
+                            std::vector<struct statx>& buffers, std::vector<int>& results)
+{
+    if (!valid())
+    {
+        return false;
+    }
+    buffers.resize(paths.size());
+    results.assign(paths.size(), 0);
+
+    size_t queued = 0, completed = 0;
+    bool unsupported = false;
+    while (completed < paths.size())
+    {
+        unsigned tail = *sq_tail;
+        while (queued < paths.size() && queued - completed < entries)
         {
-            nob_rebuild_present = true;
-            continue;
+            const unsigned index = tail & *sq_mask;
+            io_uring_sqe& sqe = static_cast<io_uring_sqe*>(sqes)[index];
+            sqe = {};
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uint64_t>(paths[queued]);
+            sqe.len = STATX_MTIME;
+            sqe.off = reinterpret_cast<uint64_t>(&buffers[queued]);
+            sqe.user_data = queued;
+            sq_array[index] = index;
+            tail++;
+            queued++;
         }
-        if (arg == "rebuild")
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Entries the kernel did not take last time are submitted again
+        const unsigned to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(SYS_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr,
+                    0) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
         {
-            rebuild_present = true;
+            return false;
         }
-        cmd_flags.push_back(arg);
+
+        unsigned head = *cq_head;
+        const unsigned ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ready; ++head)
+        {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            results[cqe.user_data] = cqe.res;
+            unsupported = unsupported || cqe.res == -EINVAL;
+            completed++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
     }
+    return !unsupported;
+}
 
-    if (nob_rebuild_present && !rebuild_present)
+inline std::filesystem::file_time_type to_file_time(const statx_timestamp& timestamp)
+{
+    const auto since_epoch = std::chrono::seconds(timestamp.tv_sec) +
+                             std::chrono::nanoseconds(timestamp.tv_nsec);
+    return std::chrono::file_clock::from_sys(
+        std::chrono::sys_time<std::chrono::nanoseconds>(since_epoch));
+}
+
+// The mtime of every path, nullopt for missing files, resolved in parallel: through
+// io_uring where the kernel allows it, otherwise by a few threads. Stat latency, not
+// CPU, is the limit, so the threads do not follow the core count.
+inline std::vector<std::optional<std::filesystem::file_time_type>> stat_mtimes(
+    const std::vector<const char*>& paths)
+{
+    std::vector<std::optional<std::filesystem::file_time_type>> mtimes(paths.size());
+
+    // A forked child shares the parent's ring mappings and would reap completions
+    // meant for another process, so every process sets up its own
+    static std::unique_ptr<StatxRing> ring;
+    static pid_t ring_owner = 0;
+    if (ring_owner != getpid())
+    {
+        ring = std::make_unique<StatxRing>();
+        ring_owner = getpid();
+    }
+    std::vector<struct statx> buffers;
+    std::vector<int> results;
+    if (paths.size() > 1 && ring->stat(paths, buffers, results))
+    {
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            if (results[i] == 0)
+            {
+                mtimes[i] = to_file_time(buffers[i].stx_mtime);
+            }
+        }
+        return mtimes;
+    }
+
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next++) < paths.size();)
+        {
+            struct statx buffer;
+            if (statx(AT_FDCWD, paths[i], 0, STATX_MTIME, &buffer) == 0)
+            {
+                mtimes[i] = to_file_time(buffer.stx_mtime);
+            }
+        }
+    };
+    std::vector<std::thread> threads(std::min<size_t>(paths.size() / 64, 15));
+    for (auto& thread : threads)
+    {
+        thread = std::thread(work);
+    }
+    work();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    return mtimes;
+}
+
+// ----------------------------------------------------------------------------------
+// String table
+// ----------------------------------------------------------------------------------
+
+// Process-wide table of interned strings. Paths, flags and command names are stored
+// once and referred to by a 32-bit id; the strings never move, so references into
+// the table stay valid.
+class StringTable
+{
+  public:
+    using Id = uint32_t;
+
+    Id intern(std::string_view string);
+    const std::string& get(Id id) const;
+
+  private:
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, Id> ids;
+};
+
+inline StringTable& string_table()
+{
+    static StringTable table;
+    return table;
+}
+
+inline StringTable::Id StringTable::intern(std::string_view string)
+{
+    auto it = ids.find(string);
+    if (it != ids.end())
+    {
+        return it->second;
+    }
+    const Id id = static_cast<Id>(strings.size());
+    ids.emplace(strings.emplace_back(string), id);
+    return id;
+}
+
+inline const std::string& StringTable::get(Id id) const
+{
+    return strings[id];
+}
+
+// Hash-consed lists of interned strings. Every distinct list, like the flags shared
+// by all translation units of a target, exists once and is referred to by id.
+class FlagSets
+{
+  public:
+    using Id = uint32_t;
+
+    Id intern(const std::vector<StringTable::Id>& flags);
+    Id intern(const std::vector<std::string>& flags);
+    Id concat(Id first, Id second);
+    const std::vector<StringTable::Id>& get(Id id) const;
+    uint64_t hash(Id id, uint64_t seed) const;
+
+  private:
+    std::deque<std::vector<StringTable::Id>> sets;
+    std::unordered_map<uint64_t, std::vector<Id>> buckets;
+    // Command hashes continue one running hash through all arguments, so a set's
+    // part depends on what came before it; memoized per preceding hash
+    mutable std::deque<std::unordered_map<uint64_t, uint64_t>> hashes;
+};
+
+inline FlagSets& flag_sets()
+{
+    static FlagSets sets;
+    return sets;
+}
+
+inline FlagSets::Id FlagSets::intern(const std::vector<StringTable::Id>& flags)
+{
+    const uint64_t key = hash_string(std::string_view(
+        reinterpret_cast<const char*>(flags.data()), flags.size() * sizeof(flags[0])));
+    std::vector<Id>& bucket = buckets[key];
+    for (Id id : bucket)
+    {
+        if (sets[id] == flags)
+        {
+            return id;
+        }
+    }
+    const Id id = static_cast<Id>(sets.size());
+    sets.push_back(flags);
+    hashes.emplace_back();
+    bucket.push_back(id);
+    return id;
+}
+
+inline FlagSets::Id FlagSets::intern(const std::vector<std::string>& flags)
+{
+    std::vector<StringTable::Id> ids;
+    ids.reserve(flags.size());
+    for (const auto& flag : flags)
+    {
+        ids.push_back(string_table().intern(flag));
+    }
+    return intern(ids);
+}
+
+inline FlagSets::Id FlagSets::concat(Id first, Id second)
+{
+    std::vector<StringTable::Id> flags = sets[first];
+    flags.insert(flags.end(), sets[second].begin(), sets[second].end());
+    return intern(flags);
+}
+
+inline const std::vector<StringTable::Id>& FlagSets::get(Id id) const
+{
+    return sets[id];
+}
+
+// The running hash of CompileCommand::hash_args after the flags of set id, starting
+// from seed
+inline uint64_t FlagSets::hash(Id id, uint64_t seed) const
+{
+    auto [it, inserted] = hashes[id].try_emplace(seed, seed);
+    if (inserted)
+    {
+        for (StringTable::Id flag : sets[id])
+        {
+            it->second = hash_string(std::string_view("\0", 1), it->second);
+            it->second = hash_string(string_table().get(flag), it->second);
+        }
+    }
+    return it->second;
+}
+
+// ----------------------------------------------------------------------------------
+// Path table
+// ----------------------------------------------------------------------------------
+
+// Process-wide table of interned paths. Headers shared by many translation units
+// become one node each, and every path is stat'ed at most once until invalidated.
+// The path strings live in the string table, so references to them stay valid.
+class PathTable
+{
+  public:
+    using Id = uint32_t;
+
+    Id intern(const std::string& path);
+    const std::string& path(Id id) const;
+    std::optional<std::filesystem::file_time_type> mtime(Id id);
+    std::optional<std::filesystem::file_time_type> mtime(const std::string& path);
+    void prefetch(const std::vector<Id>& ids);
+    void invalidate(const std::string& path);
+    void invalidate_all();
+
+  private:
+    struct Stat
+    {
+        bool known = false;
+        std::optional<std::filesystem::file_time_type> mtime;
+    };
+
+    std::unordered_map<StringTable::Id, Id> ids;
+    std::vector<const std::string*> paths;
+    std::vector<Stat> stats;
+};
+
+inline PathTable& path_table()
+{
+    static PathTable table;
+    return table;
+}
+
+inline PathTable::Id PathTable::intern(const std::string& path)
+{
+    const StringTable::Id normal =
+        string_table().intern(std::filesystem::path(path).lexically_normal().string());
+    const Id next = static_cast<Id>(paths.size());
+    auto [it, inserted] = ids.try_emplace(normal, next);
+    if (inserted)
+    {
+        paths.push_back(&string_table().get(normal));
+        stats.emplace_back();
+    }
+    return it->second;
+}
+
+inline const std::string& PathTable::path(Id id) const
+{
+    return *paths[id];
+}
+
+// Missing files have no mtime
+inline std::optional<std::filesystem::file_time_type> PathTable::mtime(Id id)
+{
+    Stat& stat = stats[id];
+    if (!stat.known)
+    {
+        std::error_code ec;
+        auto time = std::filesystem::last_write_time(*paths[id], ec);
+        stat.mtime = ec ? std::nullopt : std::optional(time);
+        stat.known = true;
+    }
+    return stat.mtime;
+}
+
+inline std::optional<std::filesystem::file_time_type> PathTable::mtime(
+    const std::string& path)
+{
+    return mtime(intern(path));
+}
+
+// Stats every id not known yet in one batch, see stat_mtimes
+inline void PathTable::prefetch(const std::vector<Id>& ids)
+{
+    std::vector<Id> unknown;
+    std::vector<const char*> names;
+    for (Id id : ids)
+    {
+        if (!stats[id].known)
+        {
+            stats[id].known = true;
+            unknown.push_back(id);
+            names.push_back(paths[id]->c_str());
+        }
+    }
+    const auto mtimes = stat_mtimes(names);
+    for (size_t i = 0; i < unknown.size(); ++i)
+    {
+        stats[unknown[i]].mtime = mtimes[i];
+    }
+}
+
+inline void PathTable::invalidate(const std::string& path)
+{
+    stats[intern(path)].known = false;
+}
+
+inline void PathTable::invalidate_all()
+{
+    for (auto& stat : stats)
+    {
+        stat.known = false;
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// Dependency log
+// ----------------------------------------------------------------------------------
+
+inline std::filesystem::path to_dependency_path(const std::filesystem::path& object)
+{
+    return object.parent_path().string() + "/" + object.stem().string() + ".d";
+}
+
+inline std::vector<std::string> parse_dependency_file(
+    const std::filesystem::path& d_file_path);
+inline std::vector<std::string> system_includes(const std::string& path);
+
+// Append-only binary database of the headers every object was compiled against,
+// replacing the per-object .d files. Records are either a path, which implicitly
+// gets the next id, or the output id, output mtime and header ids of one object.
+// The whole file is read with a single mmap and rewritten once mostly stale.
+// Writers append under an flock and first catch up with whatever other processes
+// appended, or start over when the file was removed or replaced, as the implicit
+// ids are only valid for the file they were read from.
+class DepsLog
+{
+  public:
+    struct Deps
+    {
+        std::filesystem::file_time_type mtime;
+        std::vector<PathTable::Id> headers;
+    };
+
+    explicit DepsLog(const std::filesystem::path& path = "build/.nobcpp_deps");
+    ~DepsLog();
+    DepsLog(const DepsLog&) = delete;
+    DepsLog& operator=(const DepsLog&) = delete;
+
+    const Deps* find(const std::string& output) const;
+    const Deps* find(PathTable::Id output) const;
+    void record(const std::string& output, const Deps& deps);
+    bool ingest(const std::string& output);
+    void reload();
+
+  private:
+    static constexpr char magic[] = "nobcppdeps\n";
+    static constexpr uint32_t version = 1;
+    static constexpr uint32_t deps_flag = 0x80000000u;
+
+    std::filesystem::path path;
+    int fd = -1;
+    std::unordered_map<PathTable::Id, Deps> records;
+    std::unordered_map<PathTable::Id, uint32_t> log_ids;
+    uint32_t next_log_id = 0;
+    size_t record_count = 0;
+    // The file the ids above belong to, and how much of it they cover
+    dev_t synced_device = 0;
+    ino_t synced_inode = 0;
+    off_t synced_size = -1;
+
+    void read();
+    void read(int in, bool locked);
+    void forget();
+    bool open_for_append();
+    bool sync();
+    void append(const std::string& payload, uint32_t header);
+    uint32_t log_id(PathTable::Id id);
+    void recompact();
+};
+
+inline DepsLog& deps_log()
+{
+    static DepsLog log;
+    return log;
+}
+
+inline DepsLog::DepsLog(const std::filesystem::path& path) : path(path)
+{
+    read();
+    if (record_count > 1000 && record_count > 3 * records.size())
+    {
+        recompact();
+    }
+}
+
+inline DepsLog::~DepsLog()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+inline void DepsLog::read()
+{
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+    {
+        return;
+    }
+    read(in, false);
+    close(in);
+}
+
+// Only a reader holding the lock cuts a bad or torn file back. Without it, the torn
+// record may be one another process is appending, so the file is left alone and
+// marked unsynced, and the next append re-reads it under the lock.
+inline void DepsLog::read(int in, bool locked)
+{
+    struct stat info;
+    if (fstat(in, &info) == -1)
+    {
+        return;
+    }
+    synced_device = info.st_dev;
+    synced_inode = info.st_ino;
+    synced_size = info.st_size;
+    if (info.st_size == 0)
+    {
+        return;
+    }
+    const size_t size = static_cast<size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return;
+    }
+
+    const char* data = static_cast<const char*>(mapping);
+    size_t offset = sizeof(magic) - 1 + sizeof(version);
+    uint32_t file_version = 0;
+    if (size >= offset)
+    {
+        std::memcpy(&file_version, data + sizeof(magic) - 1, sizeof(file_version));
+    }
+    if (size < offset || std::memcmp(data, magic, sizeof(magic) - 1) != 0 ||
+        file_version != version)
+    {
+        // Unknown format, start over
+        munmap(mapping, size);
+        if (!locked)
+        {
+            synced_size = -1;
+        }
+        else if (truncate(path.c_str(), 0) == -1)
+        {
+            perror("truncate");
+        }
+        else
+        {
+            synced_size = 0;
+        }
+        return;
+    }
+
+    PathTable& paths = path_table();
+    std::vector<PathTable::Id> ids;
+    size_t valid_end = offset;
+    while (offset + sizeof(uint32_t) <= size)
+    {
+        uint32_t header;
+        std::memcpy(&header, data + offset, sizeof(header));
+        const size_t length = header & ~deps_flag;
+        const char* payload = data + offset + sizeof(header);
+        if (length % 4 != 0 || offset + sizeof(header) + length > size)
+        {
+            break;
+        }
+
+        if (header & deps_flag)
+        {
+            int64_t ticks;
+            uint32_t output;
+            if (length < sizeof(output) + sizeof(ticks))
+            {
+                break;
+            }
+            std::memcpy(&output, payload, sizeof(output));
+            std::memcpy(&ticks, payload + sizeof(output), sizeof(ticks));
+            const size_t count = (length - sizeof(output) - sizeof(ticks)) / 4;
+            if (output >= ids.size())
+            {
+                break;
+            }
+            Deps deps{std::filesystem::file_time_type(
+                          std::filesystem::file_time_type::duration(ticks)),
+                      {}};
+            deps.headers.reserve(count);
+            bool valid = true;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32_t header_id;
+                std::memcpy(&header_id, payload + sizeof(output) + sizeof(ticks) + 4 * i,
+                            sizeof(header_id));
+                valid = valid && header_id < ids.size();
+                deps.headers.push_back(valid ? ids[header_id] : 0);
+            }
+            if (!valid)
+            {
+                break;
+            }
+            records[ids[output]] = std::move(deps);
+            record_count++;
+        }
+        else
+        {
+            // NUL padded to four bytes
+            std::string name(payload, strnlen(payload, length));
+            const PathTable::Id id = paths.intern(name);
+            log_ids[id] = static_cast<uint32_t>(ids.size());
+            ids.push_back(id);
+        }
+        offset += sizeof(header) + length;
+        valid_end = offset;
+    }
+    munmap(mapping, size);
+    next_log_id = static_cast<uint32_t>(ids.size());
+
+    // Drop a torn trailing record left by an interrupted build
+    if (valid_end != size)
+    {
+        if (!locked)
+        {
+            synced_size = -1;
+        }
+        else if (truncate(path.c_str(), static_cast<off_t>(valid_end)) == -1)
+        {
+            perror("truncate");
+        }
+        else
+        {
+            synced_size = static_cast<off_t>(valid_end);
+        }
+    }
+}
+
+inline void DepsLog::forget()
+{
+    records.clear();
+    log_ids.clear();
+    next_log_id = 0;
+    record_count = 0;
+    synced_device = 0;
+    synced_inode = 0;
+    synced_size = -1;
+}
+
+inline const DepsLog::Deps* DepsLog::find(const std::string& output) const
+{
+    return find(path_table().intern(output));
+}
+
+inline const DepsLog::Deps* DepsLog::find(PathTable::Id output) const
+{
+    auto it = records.find(output);
+    return it == records.end() ? nullptr : &it->second;
+}
+
+// Opens the log and takes its lock, reopening it when the file was removed, e.g. by
+// cleanall, or replaced by a recompaction since
+inline bool DepsLog::open_for_append()
+{
+    while (true)
+    {
+        if (fd == -1)
+        {
+            std::error_code ec;
+            std::filesystem::create_directories(path.parent_path(), ec);
+            fd = open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                return false;
+            }
+        }
+        if (flock(fd, LOCK_EX) == -1)
+        {
+            return false;
+        }
+        struct stat open_info, path_info;
+        if (fstat(fd, &open_info) == 0 && stat(path.c_str(), &path_info) == 0 &&
+            open_info.st_dev == path_info.st_dev && open_info.st_ino == path_info.st_ino)
+        {
+            return true;
+        }
+        close(fd);
+        fd = -1;
+    }
+}
+
+// With the lock held: re-reads the log when another process wrote to it, and writes
+// the file header into an empty one
+inline bool DepsLog::sync()
+{
+    struct stat info;
+    if (fstat(fd, &info) == -1)
+    {
+        return false;
+    }
+    if (info.st_dev == synced_device && info.st_ino == synced_inode &&
+        info.st_size == synced_size && synced_size != 0)
+    {
+        return true;
+    }
+    forget();
+    if (info.st_size != 0)
+    {
+        read(fd, true);
+        return true;
+    }
+
+    std::string header(magic, sizeof(magic) - 1);
+    header.append(reinterpret_cast<const char*>(&version), sizeof(version));
+    const ssize_t written = write(fd, header.data(), header.size());
+    if (written != static_cast<ssize_t>(header.size()))
+    {
+        return false;
+    }
+    synced_device = info.st_dev;
+    synced_inode = info.st_ino;
+    synced_size = static_cast<off_t>(header.size());
+    return true;
+}
+
+inline void DepsLog::append(const std::string& payload, uint32_t header)
+{
+    std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(payload);
+    if (write(fd, record.data(), record.size()) == -1)
+    {
+        perror("write");
+        return;
+    }
+    synced_size += static_cast<off_t>(record.size());
+}
+
+inline uint32_t DepsLog::log_id(PathTable::Id id)
+{
+    auto it = log_ids.find(id);
+    if (it != log_ids.end())
+    {
+        return it->second;
+    }
+    std::string name = path_table().path(id);
+    name.resize((name.size() + 4) & ~size_t(3), '\0');
+    append(name, static_cast<uint32_t>(name.size()));
+    return log_ids[id] = next_log_id++;
+}
+
+inline void DepsLog::record(const std::string& output, const Deps& deps)
+{
+    const PathTable::Id output_id = path_table().intern(output);
+    auto unchanged = [&] {
+        auto it = records.find(output_id);
+        return it != records.end() && it->second.mtime == deps.mtime &&
+               it->second.headers == deps.headers;
+    };
+    if (unchanged() || !open_for_append())
+    {
+        return;
+    }
+    if (!sync() || unchanged())
+    {
+        flock(fd, LOCK_UN);
+        return;
+    }
+
+    const uint32_t output_log_id = log_id(output_id);
+    std::vector<uint32_t> header_log_ids;
+    header_log_ids.reserve(deps.headers.size());
+    for (PathTable::Id header : deps.headers)
+    {
+        header_log_ids.push_back(log_id(header));
+    }
+
+    const int64_t ticks = deps.mtime.time_since_epoch().count();
+    std::string payload(reinterpret_cast<const char*>(&output_log_id),
+                        sizeof(output_log_id));
+    payload.append(reinterpret_cast<const char*>(&ticks), sizeof(ticks));
+    payload.append(reinterpret_cast<const char*>(header_log_ids.data()),
+                   header_log_ids.size() * sizeof(uint32_t));
+    append(payload, static_cast<uint32_t>(payload.size()) | deps_flag);
+    flock(fd, LOCK_UN);
+
+    records[output_id] = deps;
+    record_count++;
+}
+
+// Moves the .d file the compiler just wrote for `output` into the log
+inline bool DepsLog::ingest(const std::string& output)
+{
+    const std::filesystem::path dfile = to_dependency_path(output);
+    std::vector<std::string> header_paths;
+    try
+    {
+        header_paths = parse_dependency_file(dfile);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+    const auto mtime = path_table().mtime(output);
+    if (!mtime)
+    {
+        return false;
+    }
+
+    Deps deps{*mtime, {}};
+    deps.headers.reserve(header_paths.size());
+    for (const auto& header : header_paths)
+    {
+        deps.headers.push_back(path_table().intern(header));
+    }
+    record(output, deps);
+    std::error_code ec;
+    std::filesystem::remove(dfile, ec);
+    return true;
+}
+
+// Picks up what another process, e.g. a build forked by the daemon, wrote to the log
+inline void DepsLog::reload()
+{
+    if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    forget();
+    read();
+}
+
+// Rewrites the log with only the latest record per output
+inline void DepsLog::recompact()
+{
+    const std::filesystem::path live_path = path;
+    const std::filesystem::path temp_path = live_path.string() + ".recompact";
+
+    // Writers wait on the live log until it is replaced and then reopen it. Another
+    // process may have recompacted it first, or appended since it was read.
+    const int live_fd = open(live_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat open_info, path_info;
+    if (live_fd == -1 || flock(live_fd, LOCK_EX) == -1 || fstat(live_fd, &open_info) ||
+        stat(live_path.c_str(), &path_info) || open_info.st_ino != path_info.st_ino ||
+        open_info.st_dev != path_info.st_dev)
+    {
+        if (live_fd != -1)
+        {
+            close(live_fd);
+        }
+        return;
+    }
+    forget();
+    read(live_fd, true);
+    const auto live = std::move(records);
+    forget();
+
+    std::error_code ec;
+    std::filesystem::remove(temp_path, ec);
+    path = temp_path;
+    for (const auto& [output, deps] : live)
+    {
+        record(path_table().path(output), deps);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    path = live_path;
+
+    std::filesystem::rename(temp_path, live_path, ec);
+    if (ec)
+    {
+        // Keep using the old log, whose ids were just forgotten
+        std::filesystem::remove(temp_path, ec);
+        forget();
+        read(live_fd, true);
+    }
+    close(live_fd);
+}
+
+// ----------------------------------------------------------------------------------
+// Type definitions
+// ----------------------------------------------------------------------------------
+
+// Executor settings, set from command line options by Unit::parse
+struct BuildOptions
+{
+    int jobs = 0; // 0: one per hardware thread
+    // Jobs are only started while the peak RSS expected from their previous runs fits
+    // the budget; 0 disables the budget
+    uint64_t memory_budget_kb = 0;
+    uint64_t default_job_rss_kb = 512 * 1024;
+    // Shrink and regrow the number of running jobs, up to the -j limit, following
+    // the CPU and memory pressure stall information of the host
+    bool adaptive = false;
+    // Most jobs of a pool that run at once, like ninja's pools; 0 means unlimited
+    std::unordered_map<std::string, int> pools{{"link", 2}};
+    // Stop starting jobs after this many failures, like ninja's -k; 0 means never.
+    // Dependents of a failed job are skipped either way.
+    int keep_going = 1;
+    // Precompile the external headers most compiles of a target include, see
+    // BuildGraph::plan_precompiled_headers
+    bool pch = false;
+};
+
+static BuildOptions build_options;
+
+enum class TargetType
+{
+    EXECUTABLE,
+    STATIC_LIB,
+    DYNAMIC_LIB,
+    OBJECT,
+    NONE
+};
+
+class CompileCommand
+{
+  private:
+    StringTable::Id command;
+    // The arguments are the concatenation of shared flag sets, typically the -fPIC
+    // set, the flags of the target and a set of this command's own paths
+    std::vector<FlagSets::Id> arg_sets;
+    // Built on first use; most commands of a no-op build never run
+    mutable std::shared_ptr<const ArgvArena> argv;
+    StringTable::Id output;
+    uint64_t hash;
+    bool enabled;
+    bool compile;
+    StringTable::Id pool;
+    // Contents of a source nobcpp generates, written when the command is dispatched
+    std::shared_ptr<const std::string> generated_source;
+
+  public:
+    CompileCommand(const std::string& command, const std::vector<std::string> args,
+                   bool enabled, bool compile, const std::string& output = "");
+    static CompileCommand from_arg_sets(const std::string& command,
+                                        const std::vector<FlagSets::Id>& arg_sets,
+                                        bool enabled, bool compile,
+                                        const std::string& output = "");
+    bool is_enabled() const;
+    bool is_compile() const;
+    const std::string& get_pool() const;
+    void set_pool(const std::string& pool);
+    void set_generated_source(const std::string& content);
+    bool write_generated_source() const;
+    const std::string& get_command() const;
+    const std::string& get_source() const;
+    const std::string& get_output() const;
+    uint64_t get_hash() const;
+    std::vector<std::string> get_args() const;
+    static uint64_t hash_args(const std::string& command,
+                              const std::vector<std::string>& args);
+    static uint64_t hash_args(const std::string& command,
+                              const std::vector<FlagSets::Id>& arg_sets);
+    int execute() const;
+    void spawn(ProcessReactor& reactor, int job) const;
+    int report(const ProcessResult& result, const Timer& timer) const;
+    const std::string get_abs_file() const;
+    void print(std::ostream& os) const;
+    friend std::ostream& operator<<(std::ostream& os, const CompileCommand& cc);
+
+  private:
+    CompileCommand(const std::vector<FlagSets::Id>& arg_sets, const std::string& command,
+                   bool enabled, bool compile, const std::string& output);
+    const ArgvArena& get_argv() const;
+};
+
+// ccache-style store of compiled objects, addressed by the compiler identity, the
+// full command line and the contents of the source and every header it included.
+// The compiler's output is kept with each object, so warnings survive a cache hit.
+// Past its size limit the least recently used entries are evicted.
+class ObjectCache
+{
+  public:
+    explicit ObjectCache(const std::optional<std::filesystem::path>& dir = default_dir(),
+                         uint64_t max_kb = default_max_kb());
+
+    std::optional<ProcessResult> restore(const CompileCommand& compile_command) const;
+    void store(const CompileCommand& compile_command, const ProcessResult& result) const;
+
+  private:
+    std::optional<std::filesystem::path> dir;
+    uint64_t max_kb;
+    // Estimated size of the cache directory, counted on the first store
+    mutable std::optional<uint64_t> used_kb;
+    mutable std::unordered_map<std::string, std::optional<uint64_t>> file_hashes;
+
+    static std::optional<std::filesystem::path> default_dir();
+    static uint64_t default_max_kb();
+    void trim(uint64_t added_kb) const;
+    std::optional<uint64_t> file_hash(const std::string& path) const;
+    std::optional<uint64_t> manifest_key(const CompileCommand& compile_command) const;
+    std::optional<uint64_t> result_key(uint64_t manifest_key,
+                                       const std::vector<std::string>& headers) const;
+};
+
+class CompileCommands
+{
+  private:
+    std::vector<CompileCommand> cmds;
+    std::vector<std::vector<int>> outs;
+    std::vector<int> in_degree;
+    BuildLog log;
+
+    std::vector<uint64_t> critical_paths() const;
+    void print_resource_usage(std::vector<std::pair<int, ResourceUsage>> usages,
+                              size_t top = 10) const;
+
+  public:
+    int add_cmd(const CompileCommand& compile_command);
+    bool add_edge(int src, int dst);
+    bool signature_changed(const std::string& output, uint64_t command_hash) const;
+    int run(int max_parallel = 0);
+    void execute(int max_parallel = 0);
+    void write() const;
+    friend std::ostream& operator<<(std::ostream& os, CompileCommands compile_commands);
+};
+
+inline CompileCommand::CompileCommand(const std::string& command,
+                                      const std::vector<std::string> args, bool enabled,
+                                      bool compile, const std::string& output)
+    : CompileCommand(std::vector<FlagSets::Id>{flag_sets().intern(args)}, command,
+                     enabled, compile, output)
+{
+}
+
+inline CompileCommand::CompileCommand(const std::vector<FlagSets::Id>& arg_sets,
+                                      const std::string& command, bool enabled,
+                                      bool compile, const std::string& output)
+    : command(string_table().intern(command)), arg_sets(arg_sets),
+      output(string_table().intern(output)), hash(hash_args(command, arg_sets)),
+      enabled(enabled), compile(compile), pool(string_table().intern(""))
+{
+}
+
+class Profile
+{
+  private:
+    std::vector<std::string> compile_flags;
+    std::vector<std::string> link_flags;
+
+  public:
+    Profile(const std::vector<std::string>& compile_flags = {},
+            const std::vector<std::string>& link_flags = {})
+        : compile_flags(compile_flags), link_flags(link_flags)
+    {
+    }
+
+    const std::vector<std::string>& get_compile_flags() const
+    {
+        return compile_flags;
+    }
+
+    const std::vector<std::string>& get_link_flags() const
+    {
+        return link_flags;
+    }
+};
+
+// Bumped by every change to any Unit, see lowered_graph
+inline uint64_t& unit_generation()
+{
+    static uint64_t generation = 0;
+    return generation;
+}
+
+class Unit
+{
+  private:
+    std::vector<std::unique_ptr<Unit>> deps;
+    std::vector<PathTable::Id> header_deps;
+    std::optional<std::string> source_path;
+    std::optional<std::string> target_path;
+    std::optional<std::string> root_path;
+    std::vector<std::string> compile_flags;
+    std::vector<std::string> link_flags;
+    std::set<std::string> active_profiles;
+    TargetType target_type;
+    std::string compiler;
+
+    void print_depth_impl(int depth) const;
+
+    void clean_impl(CompileCommands& compile_commands) const;
+    void apply_profile(const std::string& name, const Profile& profile);
+    void relocate(const std::filesystem::path& from, const std::filesystem::path& to);
+    void serve(const std::unordered_map<std::string, Profile>& profiles);
+
+  public:
+    Unit(const std::optional<std::string>& source_path,
+         const std::optional<std::string>& target_path = std::nullopt,
+         const std::optional<std::string>& root_path = std::nullopt);
+
+    void add_dep(std::unique_ptr<Unit> unit);
+    void add_header_dep(const std::string& header);
+    void add_link_flag(const std::string& flag);
+    void add_link_flags(const std::vector<std::string>& flags);
+    void add_compile_flag(const std::string& flag);
+    void add_compile_flags(const std::vector<std::string>& flags);
+    void print_depth();
+    void set_compiler(const std::string& compiler);
+    CompileCommands compile(bool rebuild) const;
+    CompileCommands clean(bool remove_dir) const;
+    void watch() const;
+    std::string get_target() const;
+    void parse(int argc, char** argv,
+               const std::unordered_map<std::string, Profile>& profiles = {});
+    friend std::ostream& operator<<(std::ostream& os, const Unit& unit);
+    friend class BuildGraph;
+};
+
+// A Unit tree lowered into flat, index-based arrays, one entry per node. Nodes are
+// stored children first, so the dirty check is a single forward loop with no
+// recursion and no per-node allocation besides the commands it emits. Flag lists
+// are flag set ids, shared with the commands built from them.
+class BuildGraph
+{
+  public:
+    using Node = uint32_t;
+    static constexpr PathTable::Id no_path = UINT32_MAX;
+    static constexpr FlagSets::Id no_set = UINT32_MAX;
+
+    explicit BuildGraph(const Unit& root);
+
+    size_t size() const;
+    std::vector<PathTable::Id> inputs() const;
+    void prefetch() const;
+    CompileCommands compile(bool full_rebuild) const;
+
+  private:
+    std::vector<TargetType> kinds;
+    // Kind of the closest enclosing library or executable, which decides on -fPIC
+    std::vector<TargetType> link_kinds;
+    std::vector<PathTable::Id> sources;
+    std::vector<PathTable::Id> targets;
+    // Inherited plus own compile flags
+    std::vector<FlagSets::Id> compile_flag_sets;
+    std::vector<FlagSets::Id> link_flag_sets;
+    // The paths of the node's own command, "-c -o <object> <source>" for compiles and
+    // "-o <target> <inputs>..." for links; no_set for nodes without a target
+    std::vector<FlagSets::Id> output_arg_sets;
+    std::vector<StringTable::Id> compilers;
+    // The children and explicit headers of node i are [offsets[i], offsets[i + 1])
+    std::vector<uint32_t> child_offsets;
+    std::vector<Node> children;
+    std::vector<uint32_t> header_offsets;
+    std::vector<PathTable::Id> headers;
+
+    // Shared by the compiles of one target with the same compiler and flags
+    struct PrecompiledHeader
+    {
+        std::string header;
+        // Written by the PCH's command, planning does not touch the tree
+        std::string content;
+        std::string output;
+        StringTable::Id compiler;
+        std::vector<FlagSets::Id> flags;
+        std::vector<Node> users;
+    };
+
+    void lower(const Unit& root);
+    std::vector<PrecompiledHeader> plan_precompiled_headers() const;
+};
+
+inline const BuildGraph& lowered_graph(const Unit& root);
+
+// ----------------------------------------------------------------------------------
+// Parse command line args
+// ----------------------------------------------------------------------------------
+
+using CmdCommand = std::function<void(const Unit*)>;
+static std::unordered_map<std::string, CmdCommand> commands = {
+    {"build",
+     [](const Unit* unit) {
+         std::cout << "build" << std::endl;
+         CompileCommands cc = unit->compile(false);
+         cc.execute();
+         cc.write();
+     }},
+    {"clean",
+     [](const Unit* unit) {
+         std::cout << "clean" << std::endl;
+         CompileCommands cc = unit->clean(false);
+         std::cout << cc << std::endl;
+         cc.execute();
+         // The log may have gone with the build tree
+         deps_log().reload();
+     }},
+    {"cleanall",
+     [](const Unit* unit) {
+         std::cout << "clean all" << std::endl;
+         CompileCommands cc = unit->clean(true);
+         std::cout << cc << std::endl;
+         cc.execute();
+         // The log may have gone with the build tree
+         deps_log().reload();
+     }},
+    {"watch",
+     [](const Unit* unit) {
+         std::cout << "watch" << std::endl;
+         unit->watch();
+     }},
+    {"run",
+     [](const Unit* unit) {
+         std::cout << "run" << std::endl;
+         auto [output, error_output, exit_code, usage] =
+             run_process(unit->get_target(), {});
+         std::system(unit->get_target().c_str());
+     }},
+    {"rebuild", [](const Unit* unit) {
+         std::cout << "rebuild" << std::endl;
+         CompileCommands cc = unit->compile(true);
+         std::cout << cc << std::endl;
+         cc.execute();
+         cc.write();
+     }}};
+
+// Sizes are MiB unless suffixed with K, M or G
+inline std::optional<uint64_t> parse_size_kb(const std::string& text)
+{
+    size_t end = 0;
+    uint64_t value;
+    try
+    {
+        value = std::stoull(text, &end);
+    }
+    catch (const std::exception&)
+    {
+        return std::nullopt;
+    }
+    const std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k")
+        return value;
+    if (suffix.empty() || suffix == "M" || suffix == "m")
+        return value * 1024;
+    if (suffix == "G" || suffix == "g")
+        return value * 1024 * 1024;
+    return std::nullopt;
+}
+
+inline bool parse_build_option(const std::string& option)
+{
+    auto value_of = [&](const std::string& prefix) -> std::optional<std::string> {
+        if (option.starts_with(prefix))
+            return option.substr(prefix.size());
+        return std::nullopt;
+    };
+
+    if (auto jobs = value_of("-j"))
+    {
+        build_options.jobs = std::atoi(jobs->c_str());
+        return build_options.jobs > 0;
+    }
+    if (auto budget = value_of("--mem-budget="))
+    {
+        auto size = parse_size_kb(*budget);
+        build_options.memory_budget_kb = size.value_or(0);
+        return size.has_value();
+    }
+    if (option == "--adaptive")
+    {
+        build_options.adaptive = true;
+        return true;
+    }
+    if (option == "--pch")
+    {
+        build_options.pch = true;
+        return true;
+    }
+    if (auto fallback = value_of("--mem-default="))
+    {
+        auto size = parse_size_kb(*fallback);
+        if (size)
+            build_options.default_job_rss_kb = *size;
+        return size.has_value();
+    }
+    if (auto keep_going = value_of("-k"))
+    {
+        char* end = nullptr;
+        long failures = std::strtol(keep_going->c_str(), &end, 10);
+        if (end == keep_going->c_str() || *end != '\0' || failures < 0)
+            return false;
+        build_options.keep_going = static_cast<int>(failures);
+        return true;
+    }
+    if (auto pool = value_of("--pool="))
+    {
+        size_t colon = pool->rfind(':');
+        if (colon == std::string::npos || colon == 0)
+            return false;
+        char* end = nullptr;
+        long depth = std::strtol(pool->c_str() + colon + 1, &end, 10);
+        if (end == pool->c_str() + colon + 1 || *end != '\0' || depth < 0)
+            return false;
+        build_options.pools[pool->substr(0, colon)] = static_cast<int>(depth);
+        return true;
+    }
+    return false;
+}
+
+inline void Unit::parse(int argc, char** argv,
+                        const std::unordered_map<std::string, Profile>& profiles)
+{
+    std::vector<std::string> cmd_flags;
+    cmd_flags.reserve(argc - 1);
+
+    bool nob_rebuild_present = false;
+    bool rebuild_present = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "nob_rebuild")
+        {
+            nob_rebuild_present = true;
+            continue;
+        }
+        if (arg == "rebuild")
+        {
+            rebuild_present = true;
+        }
+        // ninja spells it "-k N", folded here into the single option "-kN"
+        if (arg == "-k")
+        {
+            const char* failures = i + 1 < argc ? argv[i + 1] : "";
+            if (*failures == '\0' ||
+                std::strspn(failures, "0123456789") != std::strlen(failures))
+            {
+                std::cerr << "-k needs the number of failures to keep going for"
+                          << std::endl;
+                std::exit(1);
+            }
+            arg += argv[++i];
+        }
+        cmd_flags.push_back(arg);
+    }
+
+    if (nob_rebuild_present && !rebuild_present)
+    {
+        cmd_flags.insert(cmd_flags.begin(), "rebuild");
+    }
+
+    if (cmd_flags.size() == 0)
+    {
+        std::cout << "No flags specified!" << std::endl;
+    }
+
+    for (const std::string& cmd_flag : cmd_flags)
+    {
+        if (cmd_flag == "serve")
+        {
+            serve(profiles);
+        }
+        else if (commands.contains(cmd_flag))
+        {
+            commands[cmd_flag](this);
+        }
+        else if (profiles.contains(cmd_flag))
+        {
+            const Profile& profile = profiles.at(cmd_flag);
+            apply_profile(cmd_flag, profile);
+        }
+        else if (cmd_flag.starts_with("-") && parse_build_option(cmd_flag))
+        {
+            continue;
+        }
+        else
+        {
+            std::cout << "Flag: " << cmd_flag << " unknown!" << std::endl;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------
+// CompileCommand
+// ----------------------------------------------------------------------------------
+
+inline bool CompileCommand::is_enabled() const
+{
+    return enabled;
+}
+
+inline bool CompileCommand::is_compile() const
+{
+    return compile;
+}
+
+// Commands built from flag sets share them with every other command using them
+inline CompileCommand
+CompileCommand::from_arg_sets(const std::string& command,
+                              const std::vector<FlagSets::Id>& arg_sets, bool enabled,
+                              bool compile, const std::string& output)
+{
+    return CompileCommand(arg_sets, command, enabled, compile, output);
+}
+
+inline const std::string& CompileCommand::get_pool() const
+{
+    return string_table().get(pool);
+}
+
+// Limits how many jobs of this kind run at once, see BuildOptions::pools
+inline void CompileCommand::set_pool(const std::string& pool)
+{
+    this->pool = string_table().intern(pool);
+}
+
+// The source is only written once the command runs, so planning a build leaves the
+// tree untouched
+inline void CompileCommand::set_generated_source(const std::string& content)
+{
+    generated_source = std::make_shared<const std::string>(content);
+}
+
+// Empty when the file cannot be read
+inline std::string read_text_file(const std::string& path)
+{
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+// Rewritten only on change, so its mtime tells when it last changed
+inline bool CompileCommand::write_generated_source() const
+{
+    if (!generated_source)
+    {
+        return true;
+    }
+    const std::string& source = get_source();
+    if (read_text_file(source) == *generated_source)
+    {
+        return true;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(source).parent_path(), ec);
+    if (!(std::ofstream(source) << *generated_source))
+    {
+        std::cerr << "Could not write " << source << std::endl;
+        return false;
+    }
+    path_table().invalidate(source);
+    return true;
+}
+
+inline const std::string& CompileCommand::get_command() const
+{
+    return string_table().get(command);
+}
+
+// Compile commands end with their source file
+inline const std::string& CompileCommand::get_source() const
+{
+    return string_table().get(flag_sets().get(arg_sets.back()).back());
+}
+
+inline const std::string& CompileCommand::get_output() const
+{
+    return string_table().get(output);
+}
+
+inline uint64_t CompileCommand::get_hash() const
+{
+    return hash;
+}
+
+inline std::vector<std::string> CompileCommand::get_args() const
+{
+    std::vector<std::string> args;
+    for (FlagSets::Id set : arg_sets)
+    {
+        for (StringTable::Id arg : flag_sets().get(set))
+        {
+            args.push_back(string_table().get(arg));
+        }
+    }
+    return args;
+}
+
+inline uint64_t CompileCommand::hash_args(const std::string& command,
+                                          const std::vector<std::string>& args)
+{
+    uint64_t hash = hash_string(command);
+    for (const auto& arg : args)
+    {
+        hash = hash_string(std::string_view("\0", 1), hash);
+        hash = hash_string(arg, hash);
+    }
+    return hash;
+}
+
+// Same value as for the flattened arguments, but each flag set costs one memo lookup
+inline uint64_t CompileCommand::hash_args(const std::string& command,
+                                          const std::vector<FlagSets::Id>& arg_sets)
+{
+    uint64_t hash = hash_string(command);
+    for (FlagSets::Id set : arg_sets)
+    {
+        hash = flag_sets().hash(set, hash);
+    }
+    return hash;
+}
+
+inline const ArgvArena& CompileCommand::get_argv() const
+{
+    if (!argv)
+    {
+        argv = make_argv(get_command(), get_args());
+    }
+    return *argv;
+}
+
+inline int CompileCommand::execute() const
+{
+    if (!enabled)
+    {
+        return 0;
+    }
+    if (!write_generated_source())
+    {
+        return 1;
+    }
+
+    Timer timer;
+    ProcessReactor reactor;
+    reactor.spawn(0, get_argv());
+    return report(reactor.wait().front().result, timer);
+}
+
+inline void CompileCommand::spawn(ProcessReactor& reactor, int job) const
+{
+    reactor.spawn(job, get_argv());
+}
+
+inline int CompileCommand::report(const ProcessResult& result, const Timer& timer) const
+{
+    const auto& [output, error_output, exit_code, usage] = result;
+    if (exit_code != 0)
+    {
+        std::cout << "Exit code: " << exit_code << "\n";
+    }
+    if (output.size() > 0)
+    {
+        std::cout << "stdout: \n" << output << std::endl;
+    }
+    if (error_output.size() > 0)
+    {
+        std::cout << "stderr: \n" << error_output << std::endl;
+    }
+    std::cout << "Took: " << timer << std::endl;
+    return exit_code;
+}
+
+inline const std::string CompileCommand::get_abs_file() const
+{
+    std::filesystem::path rel_path(get_source());
+    std::filesystem::path abs_path = std::filesystem::absolute(rel_path);
+    return abs_path;
+}
+
+inline void CompileCommand::print(std::ostream& os) const
+{
+    os << get_command() << " ";
+    const char* separator = "";
+    for (FlagSets::Id set : arg_sets)
+    {
+        for (StringTable::Id arg : flag_sets().get(set))
+        {
+            os << separator << string_table().get(arg);
+            separator = " ";
+        }
+    }
+}
+
+inline std::ostream& operator<<(std::ostream& os, const CompileCommand& cc)
+{
+    cc.print(os);
+    os << " enabled: " << cc.is_enabled();
+    return os;
+}
+
+// ----------------------------------------------------------------------------------
+// Object cache
+// ----------------------------------------------------------------------------------
+
+inline std::string to_hex(uint64_t value)
+{
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return oss.str();
+}
+
+// Resolved binary, size and mtime, so a compiler upgrade invalidates its objects
+inline uint64_t compiler_identity(const std::string& compiler)
+{
+    static std::unordered_map<std::string, uint64_t> identities;
+    auto it = identities.find(compiler);
+    if (it != identities.end())
+    {
+        return it->second;
+    }
+
+    std::filesystem::path binary = compiler;
+    if (compiler.find('/') == std::string::npos)
+    {
+        const char* path = std::getenv("PATH");
+        std::istringstream dirs(path ? path : "/usr/bin:/bin");
+        std::string dir;
+        while (std::getline(dirs, dir, ':'))
+        {
+            if (access((std::filesystem::path(dir) / compiler).c_str(), X_OK) == 0)
+            {
+                binary = std::filesystem::path(dir) / compiler;
+                break;
+            }
+        }
+    }
+
+    uint64_t identity = hash_string(compiler);
+    std::error_code ec;
+    binary = std::filesystem::canonical(binary, ec);
+    if (!ec)
+    {
+        auto size = std::filesystem::file_size(binary, ec);
+        auto mtime = std::filesystem::last_write_time(binary, ec).time_since_epoch();
+        identity = hash_string(binary.string(), identity);
+        identity = hash_string(std::to_string(size), identity);
+        identity = hash_string(std::to_string(mtime.count()), identity);
+    }
+    return identities[compiler] = identity;
+}
+
+inline ObjectCache::ObjectCache(const std::optional<std::filesystem::path>& dir,
+                                uint64_t max_kb)
+    : dir(dir), max_kb(max_kb)
+{
+}
+
+// $NOBCPP_CACHE_DIR (empty disables the cache), else the XDG cache directory
+inline std::optional<std::filesystem::path> ObjectCache::default_dir()
+{
+    if (const char* dir = std::getenv("NOBCPP_CACHE_DIR"))
+    {
+        return *dir ? std::optional<std::filesystem::path>(dir) : std::nullopt;
+    }
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+    {
+        return std::filesystem::path(xdg) / "nobcpp";
+    }
+    if (const char* home = std::getenv("HOME"); home && *home)
+    {
+        return std::filesystem::path(home) / ".cache" / "nobcpp";
+    }
+    return std::nullopt;
+}
+
+// $NOBCPP_CACHE_MAX, a size as for --mem-budget= (0 for no limit), else 5G
+inline uint64_t ObjectCache::default_max_kb()
+{
+    const char* max = std::getenv("NOBCPP_CACHE_MAX");
+    std::optional<uint64_t> size = max && *max ? parse_size_kb(max) : std::nullopt;
+    return size.value_or(5 * 1024 * 1024);
+}
+
+// Entries are the files sharing a key, aged by the newest of them; restores touch
+// the files they use. Trimming goes down to 90% of the limit, so it stays rare.
+inline void ObjectCache::trim(uint64_t added_kb) const
+{
+    if (max_kb == 0)
+    {
+        return;
+    }
+    struct Entry
+    {
+        std::filesystem::file_time_type used{};
+        uint64_t size = 0;
+        std::vector<std::filesystem::path> files;
+    };
+    auto scan = [&] {
+        std::unordered_map<std::string, Entry> entries;
+        std::error_code ec;
+        for (const auto& file : std::filesystem::directory_iterator(*dir, ec))
+        {
+            const std::string name = file.path().filename().string();
+            Entry& entry = entries[name.substr(0, name.find('.'))];
+            entry.used = std::max(entry.used, file.last_write_time(ec));
+            const uintmax_t size = file.file_size(ec);
+            entry.size += ec ? 0 : size / 1024 + 1;
+            entry.files.push_back(file.path());
+        }
+        return entries;
+    };
+
+    if (!used_kb)
+    {
+        used_kb = 0;
+        for (const auto& [key, entry] : scan())
+        {
+            *used_kb += entry.size;
+        }
+    }
+    *used_kb += added_kb;
+    if (*used_kb <= max_kb)
+    {
+        return;
+    }
+
+    std::unordered_map<std::string, Entry> entries = scan();
+    std::vector<const Entry*> oldest_first;
+    used_kb = 0;
+    for (const auto& [key, entry] : entries)
+    {
+        oldest_first.push_back(&entry);
+        *used_kb += entry.size;
+    }
+    std::sort(oldest_first.begin(), oldest_first.end(),
+              [](const Entry* a, const Entry* b) { return a->used < b->used; });
+    for (const Entry* entry : oldest_first)
+    {
+        if (*used_kb <= max_kb / 10 * 9)
+        {
+            break;
+        }
+        std::error_code ec;
+        for (const auto& file : entry->files)
+        {
+            std::filesystem::remove(file, ec);
+        }
+        *used_kb -= entry->size;
+    }
+}
+
+inline std::optional<uint64_t> ObjectCache::file_hash(const std::string& path) const
+{
+    auto it = file_hashes.find(path);
+    if (it != file_hashes.end())
+    {
+        return it->second;
+    }
+
+    std::optional<uint64_t> hash;
+    std::ifstream file(path, std::ios::binary);
+    if (file)
+    {
+        hash = hash_string(path);
+        char chunk[65536];
+        while (file.read(chunk, sizeof(chunk)) || file.gcount() > 0)
+        {
+            *hash = hash_string(std::string_view(chunk, file.gcount()), *hash);
+        }
+    }
+    return file_hashes[path] = hash;
+}
+
+inline std::optional<uint64_t> ObjectCache::manifest_key(
+    const CompileCommand& compile_command) const
+{
+    std::optional<uint64_t> source_hash = file_hash(compile_command.get_source());
+    if (!source_hash)
+    {
+        return std::nullopt;
+    }
+    // The working directory ends up in debug info
+    uint64_t key = compiler_identity(compile_command.get_command());
+    key = hash_string(std::filesystem::current_path().string(), key);
+    key = hash_string(to_hex(compile_command.get_hash()), key);
+    key = hash_string(to_hex(*source_hash), key);
+
+    // A compile using a precompiled header leaves it and its headers out of the .d,
+    // so they are part of the key; the PCH's own headers come from the deps log
+    const std::vector<std::string> args = compile_command.get_args();
+    for (size_t a = 0; a + 1 < args.size(); ++a)
+    {
+        std::string header = args[a + 1];
+        if (args[a] == "-include-pch" && header.ends_with(".gch"))
+        {
+            header.resize(header.size() - 4);
+        }
+        else if (args[a] != "-include")
+        {
+            continue;
+        }
+        std::vector<std::string> files{header};
+        const DepsLog::Deps* precompiled = deps_log().find(header + ".gch");
+        if (precompiled)
+        {
+            for (PathTable::Id id : precompiled->headers)
+            {
+                files.push_back(path_table().path(id));
+            }
+        }
+        else if (std::filesystem::exists(header + ".gch"))
+        {
+            return std::nullopt;
+        }
+        for (const auto& file : files)
+        {
+            std::optional<uint64_t> file_key = file_hash(file);
+            if (!file_key)
+            {
+                return std::nullopt;
+            }
+            key = hash_string(to_hex(*file_key), key);
+        }
+    }
+    return key;
+}
+
+inline std::optional<uint64_t> ObjectCache::result_key(
+    uint64_t manifest_key, const std::vector<std::string>& headers) const
+{
+    uint64_t key = manifest_key;
+    for (const auto& header : headers)
+    {
+        std::optional<uint64_t> header_hash = file_hash(header);
+        if (!header_hash)
+        {
+            return std::nullopt;
+        }
+        key = hash_string(to_hex(*header_hash), key);
+    }
+    return key;
+}
+
+inline std::optional<ProcessResult> ObjectCache::restore(
+    const CompileCommand& compile_command) const
+{
+    if (!dir)
+    {
+        return std::nullopt;
+    }
+    std::optional<uint64_t> key = manifest_key(compile_command);
+    if (!key)
+    {
+        return std::nullopt;
+    }
+
+    // The manifest lists the headers the last compile with this key included
+    std::ifstream manifest(*dir / (to_hex(*key) + ".manifest"));
+    if (!manifest)
+    {
+        return std::nullopt;
+    }
+    std::vector<std::string> headers;
+    std::string header;
+    while (std::getline(manifest, header))
+    {
+        headers.push_back(header);
+    }
+
+    std::optional<uint64_t> result = result_key(*key, headers);
+    if (!result)
+    {
+        return std::nullopt;
+    }
+    const std::filesystem::path object = *dir / (to_hex(*result) + ".o");
+    const std::filesystem::path dfile = *dir / (to_hex(*result) + ".d");
+    const std::filesystem::path output = compile_command.get_output();
+
+    // Entries without the compiler's output are misses, a hit must replay it
+    ProcessResult replay{"", "", 0};
+    for (auto [text, suffix] : {std::pair{&replay.out, ".out"}, {&replay.err, ".err"}})
+    {
+        std::ifstream file(*dir / (to_hex(*result) + suffix), std::ios::binary);
+        if (!file)
+        {
+            return std::nullopt;
+        }
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        *text = contents.str();
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(output.parent_path(), ec);
+    std::filesystem::copy_file(object, output,
+                               std::filesystem::copy_options::overwrite_existing, ec);
+    if (ec)
+    {
+        return std::nullopt;
+    }
+    std::filesystem::copy_file(dfile, to_dependency_path(output),
+                               std::filesystem::copy_options::overwrite_existing, ec);
+    if (ec)
+    {
+        return std::nullopt;
+    }
+    // Marks both entries as used, eviction goes by modification time
+    const auto now = std::filesystem::file_time_type::clock::now();
+    std::filesystem::last_write_time(object, now, ec);
+    std::filesystem::last_write_time(*dir / (to_hex(*key) + ".manifest"), now, ec);
+    return replay;
+}
+
+inline void ObjectCache::store(const CompileCommand& compile_command,
+                               const ProcessResult& result) const
+{
+    if (!dir)
+    {
+        return;
+    }
+    std::optional<uint64_t> key = manifest_key(compile_command);
+    if (!key)
+    {
+        return;
+    }
+
+    const std::filesystem::path output = compile_command.get_output();
+    const std::filesystem::path dfile = to_dependency_path(output);
+    std::vector<std::string> headers;
+    try
+    {
+        headers = parse_dependency_file(dfile);
+    }
+    catch (const std::exception&)
+    {
+        return;
+    }
+    std::optional<uint64_t> entry = result_key(*key, headers);
+    if (!entry)
+    {
+        return;
+    }
+
+    // Publish through renames so concurrent builds never see partial entries
+    std::error_code ec;
+    std::filesystem::create_directories(*dir, ec);
+    auto publish = [&](const std::filesystem::path& from, const std::string& name) {
+        const std::filesystem::path temp =
+            *dir / (name + ".tmp" + std::to_string(getpid()));
+        std::filesystem::copy_file(from, temp,
+                                   std::filesystem::copy_options::overwrite_existing, ec);
+        if (!ec)
+        {
+            std::filesystem::rename(temp, *dir / name, ec);
+        }
+        return !ec;
+    };
+    auto publish_text = [&](const std::string& text, const std::string& name) {
+        const std::filesystem::path temp =
+            *dir / (name + ".tmp" + std::to_string(getpid()));
+        if (!(std::ofstream(temp, std::ios::binary | std::ios::trunc) << text))
+        {
+            return false;
+        }
+        std::filesystem::rename(temp, *dir / name, ec);
+        return !ec;
+    };
+    // The object goes last, restore only trusts the output next to it
+    if (!publish_text(result.out, to_hex(*entry) + ".out") ||
+        !publish_text(result.err, to_hex(*entry) + ".err") ||
+        !publish(dfile, to_hex(*entry) + ".d") || !publish(output, to_hex(*entry) + ".o"))
+    {
+        return;
+    }
+
+    const std::filesystem::path manifest_temp =
+        *dir / (to_hex(*key) + ".manifest.tmp" + std::to_string(getpid()));
+    {
+        std::ofstream manifest(manifest_temp, std::ios::trunc);
+        for (const auto& header : headers)
+        {
+            manifest << header << '\n';
+        }
+    }
+    std::filesystem::rename(manifest_temp, *dir / (to_hex(*key) + ".manifest"), ec);
+
+    auto size_kb = [](const std::filesystem::path& file) -> uint64_t {
+        std::error_code ec;
+        const uintmax_t size = std::filesystem::file_size(file, ec);
+        return ec ? 0 : size / 1024 + 1;
+    };
+    trim(size_kb(output) + size_kb(dfile) +
+         (result.out.size() + result.err.size()) / 1024 + 3);
+}
+
+// ----------------------------------------------------------------------------------
+// CompileCommands
+// ----------------------------------------------------------------------------------
+
+inline int CompileCommands::add_cmd(const CompileCommand& compile_command)
+{
+    int idx = static_cast<int>(cmds.size());
+    cmds.push_back(compile_command);
+    outs.emplace_back();
+    in_degree.push_back(0);
+    return idx;
+}
+
+// Outputs without a log entry have never been built by this command line
+inline bool CompileCommands::signature_changed(const std::string& output,
+                                               uint64_t command_hash) const
+{
+    const BuildLog::Entry* entry = log.find(output);
+    return !entry || entry->failed || entry->command_hash != command_hash;
+}
+
+inline bool CompileCommands::add_edge(int src, int dst)
+{
+    if (src < 0 || dst < 0 || src >= (int)cmds.size() || dst >= (int)cmds.size())
+    {
+        return false;
+    }
+    outs[src].push_back(dst);
+    in_degree[dst]++;
+    return true;
+}
+
+// Longest path from every node to a sink, weighted by the durations the build log
+// recorded; jobs without history are assumed to take the average known duration
+inline std::vector<uint64_t> CompileCommands::critical_paths() const
+{
+    const int n = static_cast<int>(cmds.size());
+    std::vector<uint64_t> weight(n, 0);
+    std::vector<bool> known(n, false);
+    uint64_t known_total = 0;
+    int known_count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const BuildLog::Entry* entry = log.find(cmds[i].get_output());
+        if (entry && entry->duration_us != 0 && !cmds[i].get_output().empty())
+        {
+            weight[i] = entry->duration_us;
+            known[i] = true;
+            known_total += entry->duration_us;
+            known_count++;
+        }
+    }
+    const uint64_t fallback = known_count == 0 ? 1 : known_total / known_count;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!cmds[i].is_enabled())
+            weight[i] = 0;
+        else if (!known[i])
+            weight[i] = fallback;
+    }
+
+    // Topological order, then relax from the sinks backwards
+    std::vector<int> indeg = in_degree;
+    std::vector<int> order;
+    order.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+        if (indeg[i] == 0)
+            order.push_back(i);
+    }
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        for (int d : outs[order[k]])
+        {
+            if (--indeg[d] == 0)
+                order.push_back(d);
+        }
+    }
+
+    std::vector<uint64_t> path(n, 0);
+    for (auto it = order.rbegin(); it != order.rend(); ++it)
+    {
+        uint64_t longest = 0;
+        for (int d : outs[*it])
+        {
+            longest = std::max(longest, path[d]);
+        }
+        path[*it] = weight[*it] + longest;
+    }
+    return path;
+}
+
+// Returns 0 once everything is built, 1 after failures and 128 + the signal when
+// interrupted
+inline int CompileCommands::run(int max_parallel)
+{
+
+    int P = max_parallel > 0 ? max_parallel : build_options.jobs;
+    if (P <= 0)
+    {
+        unsigned hc = std::thread::hardware_concurrency();
+        P = hc == 0 ? 1 : static_cast<int>(hc);
+    }
+    if (P < 1)
+        P = 1;
+
+    const int n = static_cast<int>(cmds.size());
+    if (n == 0)
+    {
+        std::cout << "Compilation finished in: 0.00ms\n";
+        return 0;
+    }
+
+    std::vector<int> indeg(n);
+    for (int i = 0; i < n; ++i)
+    {
+        indeg[i] = cmds[i].is_enabled() ? in_degree[i] : 0; // disabled = already done
+    }
+
+    // Ready jobs follow the longest remaining path to a sink, in bands of 1/16 of the
+    // longest one. Within a band, jobs that failed last time come first, then the
+    // compiles whose source was edited since their object was written, most recent
+    // edit first; those give the first diagnostics within seconds.
+    const std::vector<uint64_t> priority = critical_paths();
+    const uint64_t longest =
+        n == 0 ? 0 : *std::max_element(priority.begin(), priority.end());
+    std::vector<uint64_t> band(n);
+    for (int i = 0; i < n; ++i)
+    {
+        band[i] = priority[i] * 16 / (longest + 1);
+    }
+    std::vector<int> urgency(n, 0);
+    std::vector<std::filesystem::file_time_type> edited_at(n);
+    for (int i = 0; i < n; ++i)
+    {
+        if (!cmds[i].is_enabled())
+            continue;
+        const BuildLog::Entry* entry = log.find(cmds[i].get_output());
+        if (entry && entry->failed)
+        {
+            urgency[i] = 2;
+        }
+        else if (cmds[i].is_compile())
+        {
+            auto source_time = path_table().mtime(cmds[i].get_source());
+            auto object_time = path_table().mtime(cmds[i].get_output());
+            if (source_time && object_time && *source_time > *object_time)
+            {
+                urgency[i] = 1;
+                edited_at[i] = *source_time;
+            }
+        }
+    }
+    auto higher_priority = [&](int a, int b) {
+        if (band[a] != band[b])
+            return band[a] > band[b];
+        if (urgency[a] != urgency[b])
+            return urgency[a] > urgency[b];
+        if (edited_at[a] != edited_at[b])
+            return edited_at[a] > edited_at[b];
+        return priority[a] != priority[b] ? priority[a] > priority[b] : a < b;
+    };
+    std::set<int, decltype(higher_priority)> ready(higher_priority);
+    int remaining = 0;
+
+    // Seed: enabled with indegree 0; disabled propagate immediately
+    for (int i = 0; i < n; ++i)
+    {
+        if (cmds[i].is_enabled())
+        {
+            remaining++;
+            if (indeg[i] == 0)
+            {
+                ready.insert(i);
+            }
+        }
+        else
+        {
+            for (int d : outs[i])
+            {
+                if (--indeg[d] == 0 && cmds[d].is_enabled())
+                    ready.insert(d);
+            }
+        }
+    }
+
+    int failures = 0;
+    std::vector<int> failed;
+    std::vector<bool> skipped(n, false);
+    int skipped_count = 0;
+    Timer timer;
+    std::vector<Timer> job_timers(n);
+
+    // Under make, every job beyond the first also needs a token from its jobserver.
+    // Otherwise the jobs are handed a jobserver of ours, sized to the parallelism.
+    std::unique_ptr<JobServer> jobserver = JobServer::from_environment();
+    if (jobserver)
+    {
+        std::cout << "Sharing jobs with the make jobserver\n";
+    }
+    else
+    {
+        jobserver = JobServer::create(P);
+    }
+    int held_tokens = 0;
+    bool waiting_for_token = false;
+    const std::unique_ptr<const ArgvArena> envp =
+        make_environment(jobserver ? jobserver->get_makeflags() : "");
+
+    // Jobs lead process groups of their own, so Ctrl-C only reaches nobcpp. It reads
+    // SIGINT and SIGTERM from a signalfd and cancels the running jobs: SIGTERM to
+    // their groups, SIGKILL once the grace period is over or on a second signal.
+    sigset_t cancel_signals, old_mask;
+    sigemptyset(&cancel_signals);
+    sigaddset(&cancel_signals, SIGINT);
+    sigaddset(&cancel_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &cancel_signals, &old_mask);
+    const int signal_fd = signalfd(-1, &cancel_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    constexpr auto cancel_grace = std::chrono::seconds(2);
+    bool cancelling = false;
+    bool killed = false;
+    int interrupted = 0;
+    int cancelled = 0;
+    Timer cancel_timer;
+
+    ProcessReactor reactor(*envp, true);
+    const ObjectCache cache;
+
+    // Peak RSS of the previous run, reserved against the memory budget while running
+    const uint64_t memory_budget_kb = build_options.memory_budget_kb;
+    uint64_t reserved_kb = 0;
+    std::vector<uint64_t> job_reserved_kb(n, 0);
+    auto expected_rss_kb = [&](int t) {
+        const BuildLog::Entry* entry = log.find(cmds[t].get_output());
+        return entry && entry->max_rss_kb != 0 ? entry->max_rss_kb
+                                               : build_options.default_job_rss_kb;
+    };
+
+    // Jobs running per pool, for the pools with a depth limit
+    std::unordered_map<std::string, int> pool_running;
+    auto pool_full = [&](int t) {
+        auto depth = build_options.pools.find(cmds[t].get_pool());
+        return depth != build_options.pools.end() && depth->second > 0 &&
+               pool_running[depth->first] >= depth->second;
+    };
+
+    // The most critical job that fits the budget and its pool; lighter jobs backfill
+    // the slots heavier ones cannot use. With nothing running, any job is admitted.
+    auto next_job = [&]() -> std::optional<int> {
+        for (auto it = ready.begin(); it != ready.end(); ++it)
+        {
+            if (pool_full(*it))
+                continue;
+            if (memory_budget_kb == 0 || reactor.running() == 0 ||
+                reserved_kb + expected_rss_kb(*it) <= memory_budget_kb)
+            {
+                int t = *it;
+                ready.erase(it);
+                return t;
+            }
+        }
+        return std::nullopt;
+    };
+
+    // Each running job occupies the lowest free slot, one trace track per slot
+    BuildTrace trace;
+    std::vector<std::pair<int, ResourceUsage>> usages;
+    std::vector<bool> busy_slots(P, false);
+    std::vector<int> job_slots(n, 0);
+    std::vector<std::chrono::microseconds> job_starts(n);
+    auto since_start = [&]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            timer.elapsed_duration());
+    };
+    auto trace_job = [&](int t, const char* category, int exit_code) {
+        if (cmds[t].get_output().empty())
+        {
+            return;
+        }
+        std::ostringstream command;
+        cmds[t].print(command);
+        trace.add({cmds[t].get_output(), category, command.str(), job_slots[t],
+                   job_starts[t], since_start(), exit_code});
+    };
+
+    auto cancel = [&](const std::string& reason) {
+        if (cancelling)
+        {
+            return;
+        }
+        cancelling = true;
+        std::cerr << reason << ", cancelling " << reactor.running() << " running jobs\n";
+        reactor.terminate(SIGTERM);
+        cancel_timer.reset();
+    };
+
+    auto release_dependents = [&](int t) {
+        for (int d : outs[t])
+        {
+            if (--indeg[d] == 0 && cmds[d].is_enabled() && !skipped[d])
+            {
+                ready.insert(d);
+            }
+        }
+    };
+
+    // Everything that needs the output of a failed job, directly or through other jobs
+    // that will run, can never run; the rest of the graph still can
+    auto skip_dependents = [&](int t) {
+        std::vector<int> stack(outs[t].begin(), outs[t].end());
+        while (!stack.empty())
+        {
+            int d = stack.back();
+            stack.pop_back();
+            if (skipped[d] || !cmds[d].is_enabled())
+                continue;
+            skipped[d] = true;
+            remaining--;
+            skipped_count++;
+            stack.insert(stack.end(), outs[d].begin(), outs[d].end());
+        }
+    };
+
+    PressureGovernor governor(P);
+    const bool adaptive = build_options.adaptive && governor.available();
+    if (build_options.adaptive && !adaptive)
+    {
+        std::cout << "No pressure stall information, running a fixed " << P << " jobs\n";
+    }
+
+    while (remaining > 0)
+    {
+        if (adaptive)
+        {
+            governor.update(static_cast<int>(reactor.running()));
+        }
+        const int limit = adaptive ? governor.get_limit() : P;
+
+        while (!cancelling && static_cast<int>(reactor.running()) < limit)
+        {
+            std::optional<int> next = next_job();
+            if (!next)
+                break;
+            const int t = *next;
+            auto free_slot = std::find(busy_slots.begin(), busy_slots.end(), false);
+            job_slots[t] = static_cast<int>(free_slot - busy_slots.begin());
+            job_starts[t] = since_start();
+            if (!cmds[t].write_generated_source())
+            {
+                failures++;
+                failed.push_back(t);
+                skip_dependents(t);
+                remaining--;
+                continue;
+            }
+            std::optional<ProcessResult> restored =
+                cmds[t].is_compile() ? cache.restore(cmds[t]) : std::nullopt;
+            if (restored)
+            {
+                // Keep the measured duration, a restore says nothing about compile time
+                std::cout << "Restored from cache: " << cmds[t].get_output() << "\n";
+                if (restored->out.size() > 0)
+                {
+                    std::cout << "stdout: \n" << restored->out << std::endl;
+                }
+                if (restored->err.size() > 0)
+                {
+                    std::cout << "stderr: \n" << restored->err << std::endl;
+                }
+                const BuildLog::Entry* entry = log.find(cmds[t].get_output());
+                log.record(cmds[t].get_output(),
+                           {cmds[t].get_hash(), entry ? entry->duration_us : 0,
+                            entry ? entry->max_rss_kb : 0});
+                path_table().invalidate(cmds[t].get_output());
+                deps_log().ingest(cmds[t].get_output());
+                trace_job(t, "cache", 0);
+                remaining--;
+                release_dependents(t);
+                continue;
+            }
+            if (jobserver && reactor.running() > 0)
+            {
+                if (!jobserver->try_acquire())
+                {
+                    ready.insert(t);
+                    waiting_for_token = true;
+                    break;
+                }
+                held_tokens++;
+            }
+            busy_slots[job_slots[t]] = true;
+            job_reserved_kb[t] = expected_rss_kb(t);
+            reserved_kb += job_reserved_kb[t];
+            pool_running[cmds[t].get_pool()]++;
+            std::cout << "Running: " << cmds[t] << "\n";
+            if (!cmds[t].get_output().empty())
+            {
+                std::filesystem::create_directories(
+                    std::filesystem::path(cmds[t].get_output()).parent_path());
+            }
+            job_timers[t].reset();
+            cmds[t].spawn(reactor, t);
+        }
+
+        if (reactor.running() == 0)
+            break;
+
+        if (waiting_for_token)
+        {
+            reactor.wake_on_readable(jobserver->get_read_fd());
+            waiting_for_token = false;
+        }
+        if (signal_fd != -1)
+        {
+            reactor.wake_on_readable(signal_fd);
+        }
+
+        // Wake up regularly to follow the pressure even while no job finishes, and to
+        // escalate to SIGKILL when the grace period is over
+        int timeout_ms = adaptive ? 250 : -1;
+        if (cancelling && !killed)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                cancel_grace - cancel_timer.elapsed_duration());
+            timeout_ms = static_cast<int>(std::max<int64_t>(left.count(), 0));
+        }
+        std::vector<ProcessReactor::Completion> completions = reactor.wait(timeout_ms);
+
+        signalfd_siginfo signal_info;
+        if (signal_fd != -1 &&
+            read(signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info))
+        {
+            if (cancelling && !killed)
+            {
+                reactor.terminate(SIGKILL);
+                killed = true;
+            }
+            interrupted = static_cast<int>(signal_info.ssi_signo);
+            cancel(strsignal(interrupted));
+        }
+        if (cancelling && !killed && cancel_timer.elapsed_duration() >= cancel_grace)
+        {
+            reactor.terminate(SIGKILL);
+            killed = true;
+        }
+
+        for (const auto& [t, result] : completions)
+        {
+            remaining--;
+            // Hand tokens back as soon as jobs finish, other make clients may wait
+            while (jobserver && held_tokens > 0 &&
+                   held_tokens >= static_cast<int>(reactor.running()))
+            {
+                jobserver->release();
+                held_tokens--;
+            }
+            busy_slots[job_slots[t]] = false;
+            reserved_kb -= job_reserved_kb[t];
+            pool_running[cmds[t].get_pool()]--;
+            usages.emplace_back(t, result.usage);
+            trace_job(t, cmds[t].is_compile() ? "compile" : "link", result.exit_code);
+            if (!cmds[t].get_output().empty())
+            {
+                path_table().invalidate(cmds[t].get_output());
+            }
+            // A killed job may leave a partial output newer than its inputs, which the
+            // next build would take as up to date
+            if (cancelling && result.exit_code >= 128)
+            {
+                const std::string& output = cmds[t].get_output();
+                if (!output.empty())
+                {
+                    std::error_code ec;
+                    std::filesystem::remove(output, ec);
+                    std::filesystem::remove(to_dependency_path(output), ec);
+                }
+                std::cout << "Cancelled: "
+                          << (output.empty() ? cmds[t].get_command() : output) << "\n";
+                cancelled++;
+                continue;
+            }
+            if (cmds[t].report(result, job_timers[t]) != 0)
+            {
+                // Keep the measurements of the last success, a failure cuts a job short
+                if (!cmds[t].get_output().empty())
+                {
+                    const BuildLog::Entry* entry = log.find(cmds[t].get_output());
+                    log.record(cmds[t].get_output(),
+                               {cmds[t].get_hash(), entry ? entry->duration_us : 0,
+                                entry ? entry->max_rss_kb : 0, true});
+                }
+                failures++;
+                failed.push_back(t);
+                skip_dependents(t);
+                // Past the -k limit, running jobs are stopped rather than waited for
+                if (build_options.keep_going != 0 && failures >= build_options.keep_going)
+                {
+                    cancel(std::to_string(failures) + " failed");
+                }
+                continue;
+            }
+
+            if (!cmds[t].get_output().empty())
+            {
+                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                    job_timers[t].elapsed_duration());
+                log.record(cmds[t].get_output(),
+                           {cmds[t].get_hash(), static_cast<uint64_t>(duration.count()),
+                            static_cast<uint64_t>(result.usage.max_rss_kb)});
+            }
+            if (cmds[t].is_compile())
+            {
+                cache.store(cmds[t], result);
+                deps_log().ingest(cmds[t].get_output());
+            }
+
+            release_dependents(t);
+        }
+    }
+
+    log.save();
+    trace.write();
+    print_resource_usage(usages);
+    if (signal_fd != -1)
+    {
+        close(signal_fd);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    if (failures != 0 || interrupted != 0)
+    {
+        if (!failed.empty())
+        {
+            std::cerr << "Failed:\n";
+        }
+        for (int t : failed)
+        {
+            const std::string& output = cmds[t].get_output();
+            std::cerr << "  " << (output.empty() ? cmds[t].get_command() : output)
+                      << "\n";
+        }
+        std::cerr << failures << " failed, " << cancelled << " cancelled, "
+                  << skipped_count << " skipped for depending on a failure, " << remaining
+                  << " not started.\n";
+        if (interrupted != 0)
+        {
+            return 128 + interrupted;
+        }
+        std::cerr << "One or more commands failed.\n";
+        return 1;
+    }
+    std::cout << "Compilation finished in: " << timer << std::endl;
+    return 0;
+}
+
+// Exits with the status of run() unless everything was built
+inline void CompileCommands::execute(int max_parallel)
+{
+    const int status = run(max_parallel);
+    if (status != 0)
+    {
+        std::exit(status);
+    }
+}
+
+// Totals plus the jobs with the highest peak RSS
+inline void CompileCommands::print_resource_usage(
+    std::vector<std::pair<int, ResourceUsage>> usages, size_t top) const
+{
+    if (usages.empty())
+    {
+        return;
+    }
+    std::sort(usages.begin(), usages.end(), [](const auto& a, const auto& b) {
+        return a.second.max_rss_kb > b.second.max_rss_kb;
+    });
+
+    using ms = std::chrono::duration<double, std::milli>;
+    ResourceUsage total;
+    for (const auto& [t, usage] : usages)
+    {
+        total.user_time += usage.user_time;
+        total.system_time += usage.system_time;
+        total.max_rss_kb = std::max(total.max_rss_kb, usage.max_rss_kb);
+        total.blocks_in += usage.blocks_in;
+        total.blocks_out += usage.blocks_out;
+    }
+
+    // Formatted apart, the fixed precision must not stick to std::cout
+    std::ostringstream table;
+    auto row = [&](const ResourceUsage& usage, const std::string& name) {
+        table << std::setw(12) << usage.max_rss_kb / 1024.0 << std::setw(12)
+              << ms(usage.user_time).count() << std::setw(12)
+              << ms(usage.system_time).count() << std::setw(10) << usage.blocks_in
+              << std::setw(10) << usage.blocks_out << "  " << name << "\n";
+    };
+    table << std::fixed << std::setprecision(1) << std::setw(12) << "peak MiB"
+          << std::setw(12) << "user ms" << std::setw(12) << "sys ms" << std::setw(10)
+          << "blk in" << std::setw(10) << "blk out"
+          << "  job\n";
+    for (size_t i = 0; i < usages.size() && i < top; ++i)
+    {
+        const auto& [t, usage] = usages[i];
+        std::ostringstream name;
+        if (cmds[t].get_output().empty())
+            cmds[t].print(name);
+        else
+            name << cmds[t].get_output();
+        row(usage, name.str());
+    }
+    row(total, "total (" + std::to_string(usages.size()) + " jobs)");
+    std::cout << table.str();
+}
+
+inline void CompileCommands::write() const
+{
+
+    std::vector<CompileCommand> filtered;
+    filtered.reserve(cmds.size());
+    for (const auto& c : cmds)
+    {
+        if (c.is_compile())
+        {
+            filtered.push_back(c);
+        }
+    }
+
+    std::ofstream out_file("compile_commands.json");
+    if (!out_file)
+    {
+        std::cerr << "Could not open compile_commands.json!" << std::endl;
+        return;
+    }
+
+    out_file << "[\n";
+    for (size_t i = 0; i < filtered.size(); i++)
+    {
+        out_file << "\t{\n";
+        out_file << "\t\t\"directory\": \".\",\n";
+        out_file << "\t\t\"command\": \"";
+        filtered[i].print(out_file);
+        out_file << "\",\n";
+        out_file << "\t\t\"file\": \"" << filtered[i].get_abs_file() << "\"\n";
+        out_file << "\t}";
+        // if (i + 1 != filtered.size())
+        {
+            out_file << ",\n";
+        }
+    }
+    // write self for c++23 standard setting
+    out_file << "\t{\n";
+    out_file << "\t\t\"directory\": \".\",\n";
+    out_file << "\t\t\"command\": \"";
+    out_file << "c++ -std=c++23 -Wall -Wextra -Wpedantic -O3 -o nobcpp nobcpp.cpp";
+    out_file << "\",\n";
+    out_file << "\t\t\"file\": "
+             << std::filesystem::absolute(std::filesystem::path("nobcpp.cpp")) << "\n";
+    out_file << "\t}";
+
+    out_file << "\n]\n";
+}
+
+inline std::ostream& operator<<(std::ostream& os, CompileCommands compile_commands)
+{
+    for (size_t i = 0; i < compile_commands.cmds.size(); ++i)
+    {
+        os << "#" << i << " " << compile_commands.cmds[i] << "\n";
+    }
+    return os;
+}
+
+// ----------------------------------------------------------------------------------
+// Unit
+// ----------------------------------------------------------------------------------
+
+inline void Unit::print_depth_impl(int depth) const
+{
+    // Recurse into dependencies
+    for (const auto& dep : deps)
+    {
+        dep->print_depth_impl(depth + 1);
+    }
+    // Recorded system headers (absolute paths, only recorded with --pch) are left out
+    std::vector<PathTable::Id> all_header_deps = header_deps;
+    if (source_path && target_path)
+    {
+        if (const DepsLog::Deps* recorded = deps_log().find(*target_path))
+        {
+            std::copy_if(recorded->headers.begin(), recorded->headers.end(),
+                         std::back_inserter(all_header_deps), [](PathTable::Id header) {
+                             return !std::filesystem::path(path_table().path(header))
+                                         .is_absolute();
+                         });
+        }
+    }
+    for (PathTable::Id header_dep : all_header_deps)
+    {
+        std::cout << std::string(2 * (depth + 1), ' ') << "Header dep: "
+                  << path_table().path(header_dep) << std::endl;
+    }
+
+    // Indent based on depth
+    for (int i = 0; i < depth; ++i)
+    {
+        std::cout << "  ";
+    }
+
+    if (source_path && target_path)
+    {
+        std::cout << "Compilation unit: ";
+    }
+    if (source_path && !target_path)
+    {
+        std::cout << "Header dep: ";
+    }
+    if (!source_path && target_path)
+    {
+        std::cout << "Target: ";
+    }
+
+    if (source_path)
+    {
+        std::cout << *source_path;
+    }
+    if (target_path)
+    {
+        std::cout << " -> " << *target_path;
+    }
+    std::cout << std::endl;
+}
+
+inline void Unit::clean_impl(CompileCommands& compile_commands) const
+{
+    for (const auto& dep : deps)
+    {
+        dep->clean_impl(compile_commands);
+    }
+    if (target_path)
+    {
+        compile_commands.add_cmd(CompileCommand(
+            "rm", {*target_path}, std::filesystem::exists(*target_path), false));
+
+        if (target_type == TargetType::OBJECT)
+        {
+
+            const auto dfile = to_dependency_path(*target_path).string();
+            compile_commands.add_cmd(
+                CompileCommand("rm", {dfile}, std::filesystem::exists(dfile), false));
+        }
+    }
+}
+
+// Every set of active profiles gets its own output tree, e.g. build/asan+debug/
+inline std::filesystem::path profile_output_root(const std::set<std::string>& profiles)
+{
+    std::string name;
+    for (const auto& profile : profiles)
+    {
+        name += (name.empty() ? "" : "+") + profile;
+    }
+    return name.empty() ? std::filesystem::path("build")
+                        : std::filesystem::path("build") / name;
+}
+
+inline void Unit::apply_profile(const std::string& name, const Profile& profile)
+{
+    const std::filesystem::path from = profile_output_root(active_profiles);
+    active_profiles.insert(name);
+    add_compile_flags(profile.get_compile_flags());
+    add_link_flags(profile.get_link_flags());
+    relocate(from, profile_output_root(active_profiles));
+}
+
+// Moves all outputs below `from` to `to`
+inline void Unit::relocate(const std::filesystem::path& from,
+                           const std::filesystem::path& to)
+{
+    for (auto& dep : deps)
+    {
+        dep->relocate(from, to);
+    }
+    unit_generation()++;
+    if (!target_path)
     {
-        cmd_flags.insert(cmd_flags.begin(), "rebuild");
+        return;
     }
-
-    if (cmd_flags.size() == 0)
+    const std::filesystem::path relative =
+        std::filesystem::path(*target_path).lexically_relative(from);
+    if (relative.empty() || *relative.begin() == "..")
     {
-        std::cout << "No flags specified!" << std::endl;
+        return;
     }
+    target_path = (to / relative).string();
+}
 
-    for (const std::string& cmd_flag : cmd_flags)
+inline Unit::Unit(const std::optional<std::string>& source_path,
+                  const std::optional<std::string>& target_path,
+                  const std::optional<std::string>& root_path)
+    : source_path(source_path), target_path(target_path), root_path(root_path),
+      target_type(TargetType::NONE), compiler("c++")
+{
+    unit_generation()++;
+    if (target_path)
     {
-        if (commands.contains(cmd_flag))
+        std::string extension = std::filesystem::path(*target_path).extension();
+        if (extension == ".a")
         {
-            commands[cmd_flag](this);
+            target_type = TargetType::STATIC_LIB;
         }
-        else if (profiles.contains(cmd_flag))
+        else if (extension == ".so")
         {
-            const Profile& profile = profiles.at(cmd_flag);
-            apply_profile(cmd_flag, profile);
+            target_type = TargetType::DYNAMIC_LIB;
         }
-        else
+        else if (extension == ".o")
         {
-            std::cout << "Flag: " << cmd_flag << " unknown!" << std::endl;
+            target_type = TargetType::OBJECT;
+        }
+        else if (extension == ".exe" || extension.empty())
+        {
+            target_type = TargetType::EXECUTABLE;
         }
     }
 }
 
-// ----------------------------------------------------------------------------------
-// CompileCommand
-// ----------------------------------------------------------------------------------
+inline void Unit::add_dep(std::unique_ptr<Unit> unit)
+{
+    if (unit->root_path)
+    {
+        add_compile_flag("-I" + *unit->root_path);
+    }
+    deps.push_back(std::move(unit));
+    unit_generation()++;
+}
 
-inline bool CompileCommand::is_enabled() const
+inline void Unit::add_header_dep(const std::string& header)
 {
-    return enabled;
+    header_deps.push_back(path_table().intern(header));
+    unit_generation()++;
 }
 
-inline bool CompileCommand::is_compile() const
+inline void Unit::add_link_flag(const std::string& flag)
 {
-    return compile;
+    link_flags.emplace_back(flag);
+    unit_generation()++;
 }
 
-inline int CompileCommand::execute() const
+inline void Unit::add_link_flags(const std::vector<std::string>& flags)
 {
-    if (!enabled)
-    {
-        return 0;
-    }
+    link_flags.insert(link_flags.end(), flags.begin(), flags.end());
+    unit_generation()++;
+}
 
-    Timer timer;
-    auto [output, error_output, exit_code] = run_process(command, args);
-    if (exit_code != 0)
-    {
-        std::cout << "Exit code: " << exit_code << "\n";
-    }
-    if (output.size() > 0)
-    {
-        std::cout << "stdout: \n" << output << std::endl;
-    }
-    if (error_output.size() > 0)
+inline void Unit::add_compile_flag(const std::string& flag)
+{
+    compile_flags.emplace_back(flag);
+    unit_generation()++;
+}
+
+inline void Unit::add_compile_flags(const std::vector<std::string>& flags)
+{
+    compile_flags.insert(compile_flags.end(), flags.begin(), flags.end());
+    unit_generation()++;
+}
+
+inline void Unit::print_depth()
+{
+    print_depth_impl(0);
+}
+
+inline void Unit::set_compiler(const std::string& compiler)
+{
+    this->compiler = compiler;
+    unit_generation()++;
+    for (auto& dep : deps)
     {
-        std::cout << "stderr: \n" << error_output << std::endl;
+        dep->set_compiler(compiler);
     }
-    std::cout << "Took: " << timer << std::endl;
-    return exit_code;
 }
 
-inline const std::string CompileCommand::get_abs_file() const
+inline CompileCommands Unit::compile(bool rebuild) const
 {
-    std::filesystem::path rel_path(args.back());
-    std::filesystem::path abs_path = std::filesystem::absolute(rel_path);
-    return abs_path;
+    return lowered_graph(*this).compile(rebuild);
 }
 
-inline void CompileCommand::print(std::ostream& os) const
+inline CompileCommands Unit::clean(bool remove_dir = false) const
 {
-    os << command << " ";
-    size_t arg_count = 0;
-    for (const auto& arg : args)
+    CompileCommands compile_commands;
+    if (!remove_dir)
     {
-        os << arg;
-        if (arg_count + 1 != args.size())
-        {
-            os << " ";
-        }
-        arg_count++;
+        clean_impl(compile_commands);
+    }
+    else
+    {
+        compile_commands.add_cmd(CompileCommand("rm", {"-r", "build"},
+                                                std::filesystem::exists("build"), false));
     }
+    return compile_commands;
 }
 
-inline std::ostream& operator<<(std::ostream& os, const CompileCommand& cc)
+inline std::string Unit::get_target() const
+{
+    return *target_path;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const Unit& unit)
 {
-    cc.print(os);
-    os << " enabled: " << cc.is_enabled();
     return os;
 }
 
 // ----------------------------------------------------------------------------------
-// CompileCommands
+// Build graph
 // ----------------------------------------------------------------------------------
 
-inline int CompileCommands::add_cmd(const CompileCommand& compile_command)
+// The root is its own link parent, like any library or executable
+inline BuildGraph::BuildGraph(const Unit& root)
 {
-    int idx = static_cast<int>(cmds.size());
-    cmds.push_back(compile_command);
-    outs.emplace_back();
-    in_degree.push_back(0);
-    return idx;
+    child_offsets.push_back(0);
+    header_offsets.push_back(0);
+    lower(root);
 }
 
-inline bool CompileCommands::add_edge(int src, int dst)
+inline size_t BuildGraph::size() const
 {
-    if (src < 0 || dst < 0 || src >= (int)cmds.size() || dst >= (int)cmds.size())
-    {
-        return false;
-    }
-    outs[src].push_back(dst);
-    in_degree[dst]++;
-    return true;
+    return kinds.size();
 }
 
-inline void CompileCommands::execute(int max_parallel) const
+// Children are appended before their parent, so every node comes after the nodes it
+// depends on. Units with a source but no target are headers of their parent. Walks
+// the tree with an explicit stack, deep dependency chains cannot overflow it.
+inline void BuildGraph::lower(const Unit& root)
 {
-
-    int P = max_parallel;
-    if (P <= 0)
+    FlagSets& sets = flag_sets();
+    PathTable& paths = path_table();
+    struct Frame
     {
-        unsigned hc = std::thread::hardware_concurrency();
-        P = hc == 0 ? 1 : static_cast<int>(hc);
-    }
-    if (P < 1)
-        P = 1;
+        const Unit* unit;
+        TargetType link_kind;
+        FlagSets::Id flags;
+        size_t next_dep;
+        // Where this unit's children start in lowered_children
+        size_t first_child;
+    };
+    std::vector<Frame> stack;
+    std::vector<Node> lowered_children;
+    auto push = [&](const Unit& unit, TargetType link_kind, FlagSets::Id inherited) {
+        if (unit.target_type == TargetType::EXECUTABLE ||
+            unit.target_type == TargetType::DYNAMIC_LIB ||
+            unit.target_type == TargetType::STATIC_LIB)
+        {
+            link_kind = unit.target_type;
+        }
+        FlagSets::Id flags = inherited;
+        if (!unit.compile_flags.empty())
+        {
+            flags = sets.concat(inherited, sets.intern(unit.compile_flags));
+        }
+        stack.push_back({&unit, link_kind, flags, 0, lowered_children.size()});
+    };
+    push(root, root.target_type, sets.intern(std::vector<std::string>{}));
 
-    const int n = static_cast<int>(cmds.size());
-    if (n == 0)
+    while (!stack.empty())
     {
-        std::cout << "Compilation finished in: 0.00ms\n";
-        return;
-    }
+        Frame& frame = stack.back();
+        const Unit& unit = *frame.unit;
+        if (frame.next_dep < unit.deps.size())
+        {
+            const Unit& dep = *unit.deps[frame.next_dep++];
+            push(dep, frame.link_kind, frame.flags);
+            continue;
+        }
 
-    // Working indegrees (atomic for concurrency)
-    std::vector<std::atomic<int>> indeg(n);
-    for (int i = 0; i < n; ++i)
-    {
-        int d = cmds[i].is_enabled() ? in_degree[i] : 0; // disabled = already done
-        indeg[i].store(d, std::memory_order_relaxed);
+        const PathTable::Id source =
+            unit.source_path ? paths.intern(*unit.source_path) : no_path;
+        const PathTable::Id target =
+            unit.target_path ? paths.intern(*unit.target_path) : no_path;
+        const auto first_child = lowered_children.begin() + frame.first_child;
+        FlagSets::Id output_args = no_set;
+        if (target != no_path && source != no_path)
+        {
+            output_args = sets.intern(std::vector<std::string>{
+                "-c", "-o", paths.path(target), paths.path(source)});
+        }
+        else if (target != no_path)
+        {
+            std::vector<std::string> link_args{"-o", paths.path(target)};
+            for (auto child = first_child; child != lowered_children.end(); ++child)
+            {
+                if (targets[*child] != no_path)
+                {
+                    link_args.push_back(paths.path(targets[*child]));
+                }
+            }
+            output_args = sets.intern(link_args);
+        }
+
+        kinds.push_back(unit.target_type);
+        link_kinds.push_back(frame.link_kind);
+        sources.push_back(source);
+        targets.push_back(target);
+        compile_flag_sets.push_back(frame.flags);
+        link_flag_sets.push_back(sets.intern(unit.link_flags));
+        output_arg_sets.push_back(output_args);
+        compilers.push_back(string_table().intern(unit.compiler));
+        children.insert(children.end(), first_child, lowered_children.end());
+        child_offsets.push_back(static_cast<uint32_t>(children.size()));
+        headers.insert(headers.end(), unit.header_deps.begin(), unit.header_deps.end());
+        for (const auto& dep : unit.deps)
+        {
+            if (!dep->target_path && dep->source_path)
+            {
+                headers.push_back(paths.intern(*dep->source_path));
+            }
+        }
+        header_offsets.push_back(static_cast<uint32_t>(headers.size()));
+
+        lowered_children.resize(frame.first_child);
+        stack.pop_back();
+        lowered_children.push_back(static_cast<Node>(kinds.size() - 1));
     }
+}
 
-    // Ready queue (MPMC via mutex+condvar)
-    struct Ready
+// Sources, explicit headers and the headers recorded by the last compiles
+inline std::vector<PathTable::Id> BuildGraph::inputs() const
+{
+    std::vector<PathTable::Id> ids(headers);
+    for (Node i = 0; i < size(); ++i)
     {
-        mutable std::mutex m;
-        std::condition_variable cv;
-        std::queue<int> q;
-        void push(int t)
+        if (sources[i] != no_path)
         {
+            ids.push_back(sources[i]);
+        }
+        if (targets[i] != no_path)
+        {
+            if (const DepsLog::Deps* recorded = deps_log().find(targets[i]))
             {
-                std::lock_guard<std::mutex> lk(m);
-                q.push(t);
+                ids.insert(ids.end(), recorded->headers.begin(), recorded->headers.end());
             }
-            cv.notify_one();
         }
+    }
+    return ids;
+}
+
+// Stats everything compile() looks at in one batch: the inputs and the targets
+inline void BuildGraph::prefetch() const
+{
+    std::vector<PathTable::Id> ids = inputs();
+    for (Node i = 0; i < size(); ++i)
+    {
+        if (targets[i] != no_path)
+        {
+            ids.push_back(targets[i]);
+        }
+    }
+    path_table().prefetch(ids);
+}
 
-        void notify_all()
+// The <...> headers that at least half the compiles of a target sharing compiler and
+// flags include are precompiled for all of them. The recorded header lists are
+// transitive and name internals that cannot be included alone, so a compile counts
+// for the headers its source and its in-tree headers name, if its recorded headers
+// show them included. Users of a PCH count its recorded headers as their own, as the
+// compiler leaves them out. The lists come from the deps log, the first build has
+// none.
+inline std::vector<BuildGraph::PrecompiledHeader>
+BuildGraph::plan_precompiled_headers() const
+{
+    PathTable& paths = path_table();
+    FlagSets& sets = flag_sets();
+    const FlagSets::Id pic_flags = sets.intern(std::vector<std::string>{"-fPIC"});
+    std::unordered_map<PathTable::Id, std::vector<std::string>> named;
+    auto names = [&](PathTable::Id file) -> const std::vector<std::string>& {
+        auto it = named.find(file);
+        if (it == named.end())
         {
-            cv.notify_all();
+            it = named.emplace(file, system_includes(paths.path(file))).first;
         }
-        bool try_pop(int& t)
+        return it->second;
+    };
+
+    std::vector<PrecompiledHeader> plans;
+    for (Node i = 0; i < size(); ++i)
+    {
+        if (targets[i] == no_path || sources[i] != no_path)
         {
-            std::lock_guard<std::mutex> lk(m);
-            if (q.empty())
-                return false;
-            t = q.front();
-            q.pop();
-            return true;
+            continue;
         }
-        bool wait_pop(int& t, std::atomic<int>& remaining, std::atomic<bool>& stop)
+        std::map<std::pair<StringTable::Id, std::vector<FlagSets::Id>>, std::vector<Node>>
+            groups;
+        for (uint32_t c = child_offsets[i]; c < child_offsets[i + 1]; ++c)
         {
-            std::unique_lock<std::mutex> lk(m);
-            cv.wait(lk, [&] {
-                return !q.empty() || remaining.load(std::memory_order_acquire) == 0 ||
-                       stop.load(std::memory_order_relaxed);
-            });
-            if (!q.empty())
+            const Node child = children[c];
+            if (sources[child] == no_path || targets[child] == no_path)
             {
-                t = q.front();
-                q.pop();
-                return true;
+                continue;
             }
-            return false;
+            std::vector<FlagSets::Id> flags;
+            if (link_kinds[child] == TargetType::DYNAMIC_LIB)
+            {
+                flags.push_back(pic_flags);
+            }
+            flags.push_back(compile_flag_sets[child]);
+            groups[{compilers[child], flags}].push_back(child);
         }
 
-        bool empty() const
+        for (auto& [key, users] : groups)
         {
-            std::lock_guard<std::mutex> lk(m);
-            return q.empty();
+            const auto& [compiler, flags] = key;
+            if (users.size() < 2)
+            {
+                continue;
+            }
+            const uint64_t flags_hash =
+                CompileCommand::hash_args(string_table().get(compiler), flags);
+            const std::string header = paths.path(targets[i]) + ".pch-" +
+                                       to_hex(flags_hash).substr(8) + ".hpp";
+            const DepsLog::Deps* precompiled = deps_log().find(header + ".gch");
+
+            std::map<std::string, size_t> counts;
+            for (Node user : users)
+            {
+                const DepsLog::Deps* recorded = deps_log().find(targets[user]);
+                if (!recorded)
+                {
+                    continue;
+                }
+                std::vector<PathTable::Id> files{sources[user]};
+                std::vector<std::string> external;
+                for (const DepsLog::Deps* deps : {recorded, precompiled})
+                {
+                    if (!deps)
+                    {
+                        continue;
+                    }
+                    for (PathTable::Id id : deps->headers)
+                    {
+                        const std::string& path = paths.path(id);
+                        if (std::filesystem::path(path).is_absolute())
+                        {
+                            external.push_back(path);
+                        }
+                        else if (deps == recorded)
+                        {
+                            files.push_back(id);
+                        }
+                    }
+                }
+                std::set<std::string> included;
+                for (PathTable::Id file : files)
+                {
+                    for (const auto& name : names(file))
+                    {
+                        const bool found = std::any_of(
+                            external.begin(), external.end(),
+                            [&](const std::string& path) {
+                                return path.ends_with("/" + name);
+                            });
+                        if (found)
+                        {
+                            included.insert(name);
+                        }
+                    }
+                }
+                for (const auto& name : included)
+                {
+                    counts[name]++;
+                }
+            }
+
+            std::string content = "// Generated by nobcpp --pch\n";
+            bool any = false;
+            for (const auto& [name, count] : counts)
+            {
+                if (2 * count >= users.size())
+                {
+                    content += "#include <" + name + ">\n";
+                    any = true;
+                }
+            }
+            if (!any)
+            {
+                continue;
+            }
+            plans.push_back({header, content, header + ".gch", compiler, flags, users});
         }
-    } ready;
+    }
+    return plans;
+}
+
+// The graph of the tree compiled last, lowered again only once a Unit changed. A
+// daemon's requests and repeated builds of one process reuse it.
+inline const BuildGraph& lowered_graph(const Unit& root)
+{
+    static std::unique_ptr<const BuildGraph> graph;
+    static const Unit* graph_root = nullptr;
+    static uint64_t graph_generation = 0;
+    if (!graph || graph_root != &root || graph_generation != unit_generation())
+    {
+        graph = std::make_unique<const BuildGraph>(root);
+        graph_root = &root;
+        graph_generation = unit_generation();
+    }
+    return *graph;
+}
 
-    std::atomic<int> remaining{0};
+// Nodes without a target emit nothing and are never out of date.
+inline CompileCommands BuildGraph::compile(bool full_rebuild) const
+{
+    prefetch();
 
-    // Seed: enabled with indegree 0; disabled propagate immediately
-    for (int i = 0; i < n; ++i)
+    CompileCommands compile_commands;
+    PathTable& paths = path_table();
+    FlagSets& sets = flag_sets();
+    const FlagSets::Id pic_flags = sets.intern(std::vector<std::string>{"-fPIC"});
+    const FlagSets::Id shared_flags = sets.intern(std::vector<std::string>{"-shared"});
+    const FlagSets::Id archive_flags = sets.intern(std::vector<std::string>{"rcs"});
+    const StringTable::Id archiver = string_table().intern("ar");
+    // Only precompiled headers need the system headers in the deps log
+    const char* dependency_flag = build_options.pch ? "-MD" : "-MMD";
+    const FlagSets::Id dependency_flags =
+        sets.intern(std::vector<std::string>{dependency_flag});
+
+    // Precompiled headers come first, the compiles using one depend on it
+    const std::vector<PrecompiledHeader> pchs =
+        build_options.pch ? plan_precompiled_headers() : std::vector<PrecompiledHeader>{};
+    std::vector<int> pch_of(size(), -1);
+    std::vector<int> pch_command_ids;
+    std::vector<bool> pch_rebuilt;
+    std::vector<FlagSets::Id> pch_include_sets;
+    for (const PrecompiledHeader& pch : pchs)
     {
-        if (cmds[i].is_enabled())
+        const auto output_time = paths.mtime(pch.output);
+        auto newer = [&](const std::optional<std::filesystem::file_time_type>& time) {
+            return !time || *time > *output_time;
+        };
+        bool rebuild = !output_time || newer(paths.mtime(pch.header)) ||
+                       read_text_file(pch.header) != pch.content;
+        const DepsLog::Deps* recorded = deps_log().find(pch.output);
+        if (!recorded && output_time && deps_log().ingest(pch.output))
         {
-            remaining.fetch_add(1, std::memory_order_relaxed);
-            if (indeg[i].load(std::memory_order_relaxed) == 0)
-            {
-                ready.push(i);
-            }
+            recorded = deps_log().find(pch.output);
+        }
+        rebuild = rebuild || !recorded || recorded->mtime < *output_time;
+        for (size_t h = 0; !rebuild && h < recorded->headers.size(); ++h)
+        {
+            rebuild = newer(paths.mtime(recorded->headers[h]));
+        }
+
+        std::vector<FlagSets::Id> args = pch.flags;
+        args.push_back(sets.intern(std::vector<std::string>{
+            dependency_flag, "-x", "c++-header", "-o", pch.output, pch.header}));
+        const std::string& compiler = string_table().get(pch.compiler);
+        rebuild = rebuild || compile_commands.signature_changed(
+                                 pch.output, CompileCommand::hash_args(compiler, args));
+        CompileCommand command = CompileCommand::from_arg_sets(
+            compiler, args, rebuild || full_rebuild, true, pch.output);
+        command.set_generated_source(pch.content);
+        pch_command_ids.push_back(compile_commands.add_cmd(command));
+        pch_rebuilt.push_back(rebuild);
+        // clang wants its PCH named, GCC picks up header.gch by itself
+        if (std::filesystem::path(compiler).filename().string().find("clang") !=
+            std::string::npos)
+        {
+            pch_include_sets.push_back(
+                sets.intern(std::vector<std::string>{"-include-pch", pch.output}));
         }
         else
         {
-            for (int d : outs[i])
+            pch_include_sets.push_back(sets.intern(
+                std::vector<std::string>{"-include", pch.header, "-Winvalid-pch"}));
+        }
+        for (Node user : pch.users)
+        {
+            pch_of[user] = static_cast<int>(pch_command_ids.size() - 1);
+        }
+    }
+
+    // Reused for every node, only the emitted commands allocate
+    std::vector<FlagSets::Id> args;
+    std::vector<bool> rebuilt(size(), false);
+    std::vector<int> command_ids(size(), -1);
+    for (Node i = 0; i < size(); ++i)
+    {
+        if (targets[i] == no_path)
+        {
+            continue;
+        }
+
+        // A missing input compares newer than anything, a missing output older
+        const auto target_time = paths.mtime(targets[i]);
+        auto newer = [&](const std::optional<std::filesystem::file_time_type>& time) {
+            return !time || *time > *target_time;
+        };
+        bool rebuild = !target_time;
+        for (uint32_t c = child_offsets[i]; c < child_offsets[i + 1]; ++c)
+        {
+            rebuild = rebuild || rebuilt[children[c]];
+        }
+
+        // Objects are out of date when the headers recorded by their last compile are
+        // unknown (a leftover .d file is migrated first) or predate them
+        const DepsLog::Deps* recorded = nullptr;
+        if (sources[i] != no_path)
+        {
+            recorded = deps_log().find(targets[i]);
+            if (!recorded && target_time &&
+                deps_log().ingest(std::string(paths.path(targets[i]))))
             {
-                int newdeg = indeg[d].fetch_sub(1, std::memory_order_acq_rel) - 1;
-                if (newdeg == 0 && cmds[d].is_enabled())
-                    ready.push(d);
+                recorded = deps_log().find(targets[i]);
             }
+            rebuild = rebuild || !recorded || recorded->mtime < *target_time;
         }
-    }
 
-    std::atomic<bool> stop{false};
-    std::atomic<int> failures{0};
-    Timer timer;
+        // Only the header that makes the target out of date is worth printing, with
+        // --pch the recorded headers include every system header
+        const std::string& target = paths.path(targets[i]);
+        auto check = [&](PathTable::Id header) {
+            if (!rebuild && newer(paths.mtime(header)))
+            {
+                std::cout << target << " is older than header " << paths.path(header)
+                          << std::endl;
+                rebuild = true;
+            }
+        };
+        for (uint32_t h = header_offsets[i]; h < header_offsets[i + 1]; ++h)
+        {
+            check(headers[h]);
+        }
+        if (recorded)
+        {
+            std::for_each(recorded->headers.begin(), recorded->headers.end(), check);
+        }
 
-    auto worker = [&]() {
-        while (true)
+        if (sources[i] != no_path)
         {
+            rebuild = rebuild || newer(paths.mtime(sources[i]));
 
-            if (stop.load(std::memory_order_relaxed))
-                break;
-            if (remaining.load(std::memory_order_acquire) == 0 && ready.empty())
-                break;
-            int t = -1;
-            if (!ready.try_pop(t))
+            // .cpp -> .o compiling
+            args.clear();
+            if (link_kinds[i] == TargetType::DYNAMIC_LIB)
             {
-
-                if (stop.load(std::memory_order_relaxed))
-                    break;
-                if (remaining.load(std::memory_order_acquire) == 0 && ready.empty())
-                    break;
-                if (!ready.wait_pop(t, remaining, stop))
-                {
-                    if (remaining.load(std::memory_order_acquire) == 0)
-                        break;
-                    if (stop.load(std::memory_order_relaxed))
-                        break;
-                    continue;
-                }
+                args.push_back(pic_flags);
             }
-
-            int code = 0;
-            try
+            args.push_back(compile_flag_sets[i]);
+            if (pch_of[i] != -1)
             {
-                std::cout << "Running: " << cmds[t] << "\n";
-                code = cmds[t].execute();
+                const PrecompiledHeader& pch = pchs[pch_of[i]];
+                rebuild =
+                    rebuild || pch_rebuilt[pch_of[i]] || newer(paths.mtime(pch.output));
+                args.push_back(pch_include_sets[pch_of[i]]);
             }
-            catch (...)
+            args.push_back(dependency_flags);
+            args.push_back(output_arg_sets[i]);
+
+            const std::string& compiler = string_table().get(compilers[i]);
+            rebuild = rebuild || compile_commands.signature_changed(
+                                     target, CompileCommand::hash_args(compiler, args));
+            command_ids[i] = compile_commands.add_cmd(CompileCommand::from_arg_sets(
+                compiler, args, rebuild || full_rebuild, true, target));
+            if (pch_of[i] != -1)
             {
-                code = -1;
+                compile_commands.add_edge(pch_command_ids[pch_of[i]], command_ids[i]);
             }
-
-            if (code != 0)
+        }
+        else
+        {
+            // .o -> .exe linking
+            args.clear();
+            StringTable::Id linker = compilers[i];
+            if (kinds[i] == TargetType::DYNAMIC_LIB)
+            {
+                args.push_back(shared_flags);
+            }
+            else if (kinds[i] == TargetType::STATIC_LIB)
+            {
+                linker = archiver;
+                args.push_back(archive_flags);
+            }
+            if (kinds[i] == TargetType::DYNAMIC_LIB || kinds[i] == TargetType::EXECUTABLE)
             {
-                failures.fetch_add(1, std::memory_order_acq_rel);
-                stop.store(true, std::memory_order_release); // fail-fast
-                ready.notify_all();
+                args.push_back(link_flag_sets[i]);
             }
+            args.push_back(output_arg_sets[i]);
 
-            for (int d : outs[t])
+            for (uint32_t c = child_offsets[i]; c < child_offsets[i + 1]; ++c)
             {
-                int newdeg = indeg[d].fetch_sub(1, std::memory_order_acq_rel) - 1;
-                if (newdeg == 0 && cmds[d].is_enabled())
+                if (targets[children[c]] != no_path)
                 {
-                    ready.push(d);
+                    rebuild = rebuild || newer(paths.mtime(targets[children[c]]));
                 }
             }
-            // remaining.fetch_sub(1, std::memory_order_acq_rel);
+            const std::string& compiler = string_table().get(linker);
+            rebuild = rebuild || compile_commands.signature_changed(
+                                     target, CompileCommand::hash_args(compiler, args));
+
+            CompileCommand link_command = CompileCommand::from_arg_sets(
+                compiler, args, rebuild || full_rebuild, false, target);
+            link_command.set_pool("link");
+            command_ids[i] = compile_commands.add_cmd(link_command);
 
-            int prev = remaining.fetch_sub(1, std::memory_order_acq_rel);
-            if (prev == 1)
+            // Wire edges from each direct child's command to this link/archive node
+            for (uint32_t c = child_offsets[i]; c < child_offsets[i + 1]; ++c)
             {
-                // Just reached zero: wake all waiters so they can observe termination
-                ready.notify_all();
+                if (command_ids[children[c]] != -1)
+                {
+                    compile_commands.add_edge(command_ids[children[c]], command_ids[i]);
+                }
             }
         }
-    };
+        rebuilt[i] = rebuild;
+    }
+    return compile_commands;
+}
 
-    std::vector<std::thread> pool;
-    pool.reserve(static_cast<size_t>(P));
-    for (int i = 0; i < P; ++i)
-        pool.emplace_back(worker);
-    for (auto& th : pool)
-        th.join();
+// ----------------------------------------------------------------------------------
+// Utils
+// ----------------------------------------------------------------------------------
 
-    if (failures.load(std::memory_order_relaxed) != 0)
-    {
-        std::cerr << "One or more commands failed.\n";
-        std::exit(1);
-    }
-    std::cout << "Compilation finished in: " << timer << std::endl;
+inline std::filesystem::path to_object_path(const std::filesystem::path& source)
+{
+    std::filesystem::path relative = source.lexically_relative("src");
+    std::filesystem::path obj_path = "build" / relative;
+    obj_path.replace_extension(".o");
+    return obj_path;
 }
 
-inline void CompileCommands::write() const
+inline std::vector<std::string> parse_dependency_file(
+    const std::filesystem::path& d_file_path)
 {
+    std::ifstream file(d_file_path);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open file: " + d_file_path.string());
+    }
 
-    std::vector<CompileCommand> filtered;
-    filtered.reserve(cmds.size());
-    for (const auto& c : cmds)
+    std::ostringstream oss;
+    std::string line;
+
+    // Handle line continuations with backslash
+    while (std::getline(file, line))
     {
-        if (c.is_compile())
+        if (!line.empty() && line.back() == '\\')
         {
-            filtered.push_back(c);
+            line.pop_back(); // remove trailing backslash
+            oss << line;
+        }
+        else
+        {
+            oss << line << ' '; // keep space for splitting
         }
     }
 
-    std::ofstream out_file("compile_commands.json");
-    if (!out_file)
-    {
-        std::cerr << "Could not open compile_commands.json!" << std::endl;
-        return;
-    }
+    std::istringstream dep_stream(oss.str());
+    std::string token;
 
-    out_file << "[\n";
-    for (size_t i = 0; i < filtered.size(); i++)
+    std::vector<std::string> headers;
+    bool after_colon = false;
+    int cpp_seen = 0;
+
+    while (dep_stream >> token)
     {
-        out_file << "\t{\n";
-        out_file << "\t\t\"directory\": \".\",\n";
-        out_file << "\t\t\"command\": \"";
-        filtered[i].print(out_file);
-        out_file << "\",\n";
-        out_file << "\t\t\"file\": \"" << filtered[i].get_abs_file() << "\"\n";
-        out_file << "\t}";
-        // if (i + 1 != filtered.size())
+        if (!after_colon)
         {
-            out_file << ",\n";
+            auto colon_pos = token.find(':');
+            if (colon_pos != std::string::npos)
+            {
+                // Start reading dependencies after ':'
+                token = token.substr(colon_pos + 1);
+                after_colon = true;
+                if (token.empty())
+                    continue;
+            }
+            else
+            {
+                continue; // still in the target part
+            }
+        }
+
+        // Skip the first non-target (assumed .cpp)
+        if (cpp_seen == 0 && token.ends_with(".cpp"))
+        {
+            cpp_seen++;
+            continue;
         }
+
+        headers.push_back(token);
     }
-    // write self for c++23 standard setting
-    out_file << "\t{\n";
-    out_file << "\t\t\"directory\": \".\",\n";
-    out_file << "\t\t\"command\": \"";
-    out_file << "c++ -std=c++23 -Wall -Wextra -Wpedantic -O3 -o nobcpp nobcpp.cpp";
-    out_file << "\",\n";
-    out_file << "\t\t\"file\": "
-             << std::filesystem::absolute(std::filesystem::path("nobcpp.cpp")) << "\n";
-    out_file << "\t}";
 
-    out_file << "\n]\n";
+    return headers;
 }
 
-inline std::ostream& operator<<(std::ostream& os, CompileCommands compile_commands)
+// The headers a file names in #include <...> lines, conditional or not
+inline std::vector<std::string> system_includes(const std::string& path)
 {
-    for (size_t i = 0; i < compile_commands.cmds.size(); ++i)
+    std::ifstream file(path);
+    std::vector<std::string> names;
+    std::string line;
+    while (std::getline(file, line))
     {
-        os << "#" << i << " " << compile_commands.cmds[i] << "\n";
+        std::string_view rest = line;
+        auto skip_blanks = [&] {
+            while (!rest.empty() && (rest.front() == ' ' || rest.front() == '\t'))
+                rest.remove_prefix(1);
+        };
+        skip_blanks();
+        if (!rest.starts_with('#'))
+            continue;
+        rest.remove_prefix(1);
+        skip_blanks();
+        if (!rest.starts_with("include"))
+            continue;
+        rest.remove_prefix(7);
+        skip_blanks();
+        const size_t close = rest.find('>');
+        if (rest.starts_with('<') && close != std::string_view::npos)
+            names.emplace_back(rest.substr(1, close - 1));
     }
-    return os;
+    return names;
 }
 
-// ----------------------------------------------------------------------------------
-// Unit
-// ----------------------------------------------------------------------------------
+// A directory find_cpp_files listed, with its mtime from before the listing. Adding,
+// removing or renaming a source file changes the mtime of its directory.
+struct ListedDirectory
+{
+    std::string path;
+    std::optional<std::filesystem::file_time_type> mtime;
+};
 
-inline void Unit::print_depth_impl(int depth) const
+inline std::vector<ListedDirectory>& listed_directories()
 {
-    // Recurse into dependencies
-    for (const auto& dep : deps)
-    {
-        dep->print_depth_impl(depth + 1);
-    }
+    static std::vector<ListedDirectory> directories;
+    return directories;
+}
 
-    // Indent based on depth
-    for (int i = 0; i < depth; ++i)
+// Every .cpp file below each root, sorted, so the graph does not depend on the
+// directory listing order. Directories are listed by a pool of threads sharing one
+// queue.
+inline std::vector<std::vector<std::filesystem::path>> find_cpp_files(
+    const std::vector<std::filesystem::path>& roots)
+{
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::pair<size_t, std::filesystem::path>> pending;
+    size_t listing = 0;
+    std::exception_ptr error;
+    std::vector<std::vector<std::filesystem::path>> found(roots.size());
+    for (size_t i = 0; i < roots.size(); ++i)
     {
-        std::cout << "  ";
+        pending.emplace_back(i, roots[i]);
     }
 
-    if (source_path && target_path)
-    {
-        std::cout << "Compilation unit: ";
-    }
-    if (source_path && !target_path)
+    auto work = [&] {
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            wakeup.wait(lock, [&] { return !pending.empty() || listing == 0; });
+            if (pending.empty())
+            {
+                return;
+            }
+            auto [root, dir] = std::move(pending.back());
+            pending.pop_back();
+            listing++;
+            lock.unlock();
+
+            // Like recursive_directory_iterator, symlinked directories are not entered
+            std::vector<std::filesystem::path> subdirs, files;
+            std::exception_ptr list_error;
+            std::error_code mtime_error;
+            const auto mtime = std::filesystem::last_write_time(dir, mtime_error);
+            try
+            {
+                for (const auto& entry : std::filesystem::directory_iterator(dir))
+                {
+                    if (entry.is_directory() && !entry.is_symlink())
+                    {
+                        subdirs.push_back(entry.path());
+                    }
+                    else if (entry.is_regular_file() &&
+                             entry.path().extension() == ".cpp")
+                    {
+                        files.push_back(entry.path());
+                    }
+                }
+            }
+            catch (...)
+            {
+                list_error = std::current_exception();
+            }
+
+            lock.lock();
+            listing--;
+            for (auto& subdir : subdirs)
+            {
+                pending.emplace_back(root, std::move(subdir));
+            }
+            found[root].insert(found[root].end(), files.begin(), files.end());
+            listed_directories().push_back(
+                {dir.string(), mtime_error ? std::nullopt : std::optional(mtime)});
+            if (list_error && !error)
+            {
+                error = list_error;
+            }
+            wakeup.notify_all();
+        }
+    };
+
+    unsigned hc = std::thread::hardware_concurrency();
+    std::vector<std::thread> threads(hc > 1 ? hc - 1 : 0);
+    for (auto& thread : threads)
     {
-        std::cout << "Header dep: ";
+        thread = std::thread(work);
     }
-    if (!source_path && target_path)
+    work();
+    for (auto& thread : threads)
     {
-        std::cout << "Target: ";
+        thread.join();
     }
 
-    if (source_path)
+    if (error)
     {
-        std::cout << *source_path;
+        std::rethrow_exception(error);
     }
-    if (target_path)
+    for (auto& files : found)
     {
-        std::cout << " -> " << *target_path;
+        std::sort(files.begin(), files.end());
     }
-    std::cout << std::endl;
+    return found;
 }
 
-inline bool Unit::compile_impl(
-    CompileCommands& compile_commands, TargetType target_type_parent,
-    const bool full_rebuild,
-    const std::vector<std::string>& inherited_compile_flags) const
+// One tree per (source directory, target) project. All projects are walked in one
+// parallel pass, see find_cpp_files.
+inline std::vector<std::unique_ptr<Unit>> build_trees_from_cpp_files(
+    const std::vector<std::pair<std::filesystem::path, std::filesystem::path>>& projects)
 {
-    std::vector<std::string> local_compile_flags;
-    local_compile_flags.insert(local_compile_flags.end(), inherited_compile_flags.begin(),
-                               inherited_compile_flags.end());
-
-    local_compile_flags.insert(local_compile_flags.end(), compile_flags.begin(),
-                               compile_flags.end());
-    // Recurse into dependencies
-    std::vector<std::string> dep_target_objects;
-    std::vector<std::string> header_deps;
-    bool parent_rebuild = false;
-
-    if (target_type == TargetType::EXECUTABLE || target_type == TargetType::DYNAMIC_LIB ||
-        target_type == TargetType::STATIC_LIB)
+    std::vector<std::filesystem::path> roots;
+    for (const auto& [root_dir, target] : projects)
     {
-        target_type_parent = target_type;
+        roots.push_back(root_dir);
     }
+    const auto sources = find_cpp_files(roots);
 
-    for (const auto& dep : deps)
+    std::vector<std::unique_ptr<Unit>> trees;
+    for (size_t i = 0; i < projects.size(); ++i)
     {
-        if (dep->target_path)
-        {
-            dep_target_objects.push_back(*dep->target_path);
-        }
-        else if (dep->source_path)
+        const auto& [root_dir, target] = projects[i];
+        auto root =
+            std::make_unique<Unit>(std::nullopt, target.string(), root_dir.string());
+        for (const auto& source : sources[i])
         {
-            header_deps.push_back(*dep->source_path);
+            std::filesystem::path obj_path = to_object_path(source);
+            // Header dependencies are looked up in the deps log when compiling
+            root->add_dep(std::make_unique<Unit>(source.string(), obj_path.string()));
         }
-        bool rebuild = dep->compile_impl(compile_commands, target_type_parent,
-                                         full_rebuild, local_compile_flags);
-        parent_rebuild |= rebuild;
+        trees.push_back(std::move(root));
     }
+    return trees;
+}
 
-    if (target_path)
-    {
-        std::filesystem::create_directories(
-            std::filesystem::path(*target_path).parent_path());
-        bool rebuild = parent_rebuild || !std::filesystem::exists(*target_path);
-        if (!header_deps.empty())
-        {
-            std::cout << *target_path << " has dependency on headers: ";
-            for (const auto& header_dep : header_deps)
-            {
-                std::cout << header_dep << ", ";
-                rebuild = rebuild || std::filesystem::last_write_time(header_dep) >
-                                         std::filesystem::last_write_time(*target_path);
-            }
-            std::cout << std::endl;
-        }
-        if (source_path)
-        {
-            rebuild = rebuild || std::filesystem::last_write_time(*source_path) >
-                                     std::filesystem::last_write_time(*target_path);
-
-            std::vector<std::string> args;
+inline std::unique_ptr<Unit> build_tree_from_cpp_files(
+    const std::filesystem::path& root_dir, const std::filesystem::path& target)
+{
+    return std::move(build_trees_from_cpp_files({{root_dir, target}}).front());
+}
 
-            if (target_type_parent == TargetType::DYNAMIC_LIB)
-            {
-                args.push_back("-fPIC");
-            }
+// ----------------------------------------------------------------------------------
+// Watch
+// ----------------------------------------------------------------------------------
 
-            args.insert(args.end(), local_compile_flags.begin(),
-                        local_compile_flags.end());
+// Builds, then rebuilds on every change until interrupted. The graph is lowered once
+// and the path table keeps its timestamps; inotify events only invalidate the paths
+// they name, so the dirty check re-stats just the changed files. Directories are
+// watched rather than files, as editors often save by renaming over the old file.
+// Source files added to or removed from the tree need a restart.
+inline void Unit::watch() const
+{
+    constexpr auto debounce = std::chrono::milliseconds(100);
+    constexpr uint32_t events = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO;
 
-            args.insert(args.end(), {"-MMD", "-c", "-o", *target_path, *source_path});
-            // .cpp -> .o compiling
-            int node = compile_commands.add_cmd(
-                CompileCommand(compiler, args, rebuild || full_rebuild, true));
-            node_id = node;
+    const int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+    {
+        perror("inotify_init1");
+        return;
+    }
+    sigset_t stop_signals, previous_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &previous_mask);
+    const int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+
+    const BuildGraph graph(*this);
+    PathTable& paths = path_table();
+
+    // A directory can be reached under several spellings, all sharing one watch
+    std::unordered_map<int, std::vector<std::string>> watched;
+    std::unordered_set<std::string> spellings;
+    auto watch_directory = [&](const std::filesystem::path& path) {
+        const std::string directory = (path / "").lexically_normal().string();
+        if (!spellings.insert(directory).second)
+        {
+            return;
         }
-        else
+        const int wd =
+            inotify_add_watch(inotify_fd, directory.empty() ? "." : directory.c_str(),
+                              events | IN_ONLYDIR);
+        if (wd != -1)
         {
-            // .o -> .exe linking
-            std::vector<std::string> args;
-
-            std::string compiler = this->compiler;
-            if (target_type == TargetType::DYNAMIC_LIB)
-            {
-                args.push_back("-shared");
-            }
-            else if (target_type == TargetType::STATIC_LIB)
-            {
-                compiler = "ar";
-                args.push_back("rcs");
-            }
-
-            if (target_type == TargetType::DYNAMIC_LIB ||
-                target_type == TargetType::EXECUTABLE)
-            {
-                args.insert(args.end(), link_flags.begin(), link_flags.end());
-            }
-
-            args.push_back("-o");
-            args.push_back(*target_path);
-
-            for (const auto& target : dep_target_objects)
-            {
-                args.push_back(target);
-                rebuild = rebuild || std::filesystem::last_write_time(target) >
-                                         std::filesystem::last_write_time(*target_path);
-            }
-
-            int link_node = compile_commands.add_cmd(
-                CompileCommand(compiler, args, rebuild || full_rebuild, false));
-            node_id = link_node;
-
-            // Wire edges from each direct child’s node to this link/archive node
-            for (const auto& dep : deps)
-            {
-                if (dep->node_id.has_value())
-                {
-                    compile_commands.add_edge(dep->node_id.value(), link_node);
-                }
-            }
+            watched[wd].push_back(directory);
         }
-        return rebuild;
-    }
-    node_id.reset();
-    return false;
-}
-
-inline void Unit::clean_impl(CompileCommands& compile_commands) const
-{
-    for (const auto& dep : deps)
+    };
+    for (const auto& directory : listed_directories())
     {
-        dep->clean_impl(compile_commands);
+        watch_directory(directory.path);
     }
-    if (target_path)
-    {
-        compile_commands.add_cmd(CompileCommand(
-            "rm", {*target_path}, std::filesystem::exists(*target_path), false));
-
-        if (target_type == TargetType::OBJECT)
+    std::unordered_set<PathTable::Id> inputs;
+    auto watch_inputs = [&] {
+        for (PathTable::Id id : graph.inputs())
         {
-
-            const auto dfile =
-                std::filesystem::path(*target_path).parent_path().string() + "/" +
-                std::filesystem::path(*target_path).stem().string() + ".d";
-            compile_commands.add_cmd(
-                CompileCommand("rm", {dfile}, std::filesystem::exists(dfile), false));
+            if (inputs.insert(id).second)
+            {
+                watch_directory(std::filesystem::path(paths.path(id)).parent_path());
+            }
         }
-    }
-}
+    };
 
-inline void Unit::apply_profile(const std::string& name, const Profile& profile)
-{
-    active_profiles.insert(name);
-    add_compile_flags(profile.get_compile_flags());
-    add_link_flags(profile.get_link_flags());
-}
+    // Returns whether an input changed
+    auto read_events = [&] {
+        bool changed = false;
+        alignas(inotify_event) char buffer[16 * 1024];
+        ssize_t length;
+        while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const auto* event =
+                    reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    paths.invalidate_all();
+                    changed = true;
+                    continue;
+                }
+                if (event->len == 0 || !watched.contains(event->wd))
+                {
+                    continue;
+                }
+                for (const auto& directory : watched.at(event->wd))
+                {
+                    const std::string file =
+                        (std::filesystem::path(directory) / event->name).string();
+                    const PathTable::Id id = paths.intern(file);
+                    if (inputs.contains(id))
+                    {
+                        paths.invalidate(file);
+                        changed = true;
+                    }
+                    else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                             file.ends_with(".cpp"))
+                    {
+                        std::cout << "New source " << file
+                                  << " is only built after restarting watch\n";
+                    }
+                }
+            }
+        }
+        return changed;
+    };
 
-inline Unit::Unit(const std::optional<std::string>& source_path,
-                  const std::optional<std::string>& target_path,
-                  const std::optional<std::string>& root_path)
-    : source_path(source_path), target_path(target_path), root_path(root_path),
-      target_type(TargetType::NONE), compiler("c++")
-{
-    if (target_path)
+    bool changed = true;
+    while (true)
     {
-        std::string extension = std::filesystem::path(*target_path).extension();
-        if (extension == ".a")
+        if (changed)
         {
-            target_type = TargetType::STATIC_LIB;
+            CompileCommands cc = graph.compile(false);
+            const int status = cc.run();
+            if (status >= 128)
+            {
+                break;
+            }
+            cc.write();
+            // The compiles may have recorded new headers
+            watch_inputs();
+            std::cout << "Watching for changes, Ctrl-C to stop" << std::endl;
+            changed = false;
         }
-        else if (extension == ".so")
+
+        pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, signal_fd == -1 ? 1 : 2, -1) == -1)
         {
-            target_type = TargetType::DYNAMIC_LIB;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
         }
-        else if (extension == ".o")
+        if (signal_fd != -1 && fds[1].revents != 0)
         {
-            target_type = TargetType::OBJECT;
+            signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == -1)
+            {
+                perror("read");
+            }
+            break;
         }
-        else if (extension == ".exe" || extension.empty())
+        changed = read_events();
+
+        // A burst of saves, e.g. a branch switch or a search and replace, is built
+        // once it went quiet
+        pollfd quiet{inotify_fd, POLLIN, 0};
+        while (changed && poll(&quiet, 1, static_cast<int>(debounce.count())) > 0)
         {
-            target_type = TargetType::EXECUTABLE;
+            read_events();
         }
     }
-}
 
-inline void Unit::add_dep(std::unique_ptr<Unit> unit)
-{
-    if (unit->root_path)
+    close(inotify_fd);
+    if (signal_fd != -1)
     {
-        add_compile_flag("-I" + *unit->root_path);
+        close(signal_fd);
     }
-    deps.push_back(std::move(unit));
-}
-
-inline void Unit::add_link_flag(const std::string& flag)
-{
-    link_flags.emplace_back(flag);
+    sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
 }
 
-inline void Unit::add_link_flags(const std::vector<std::string>& flags)
-{
-    link_flags.insert(link_flags.end(), flags.begin(), flags.end());
-}
+// ----------------------------------------------------------------------------------
+// Daemon
+// ----------------------------------------------------------------------------------
 
-inline void Unit::add_compile_flag(const std::string& flag)
-{
-    compile_flags.emplace_back(flag);
-}
+// `./nobcpp serve` keeps the Unit trees, the interned paths and flag sets and the deps
+// log in memory, and answers later invocations from the same directory. The client
+// sends its command line, environment and standard streams over a Unix socket; the
+// daemon forks a child that runs them on the warm state and replies with its exit
+// code. Forking keeps the profiles and options of one request out of the next.
+static constexpr char daemon_socket[] = "build/.nobcpp_sock";
 
-inline void Unit::add_compile_flags(const std::vector<std::string>& flags)
+// The binary sending the request, so a daemon never serves a rebuilt nobcpp. The
+// command line and the environment follow, each string NUL terminated.
+struct DaemonRequest
 {
-    compile_flags.insert(compile_flags.end(), flags.begin(), flags.end());
-}
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    int64_t mtime_ns = 0;
+    uint32_t argc = 0;
+};
 
-inline void Unit::print_depth()
+struct DaemonReply
 {
-    print_depth_impl(0);
-}
+    int32_t served = 0; // 0: the daemon retired, build locally
+    int32_t exit_code = 0;
+};
 
-inline void Unit::set_compiler(const std::string& compiler)
+inline bool identify_self(DaemonRequest& request)
 {
-    this->compiler = compiler;
-    for (auto& dep : deps)
+    struct stat info;
+    if (stat("/proc/self/exe", &info) == -1)
     {
-        dep->set_compiler(compiler);
+        return false;
     }
+    request.device = info.st_dev;
+    request.inode = info.st_ino;
+    request.mtime_ns = info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
+    return true;
 }
 
-inline CompileCommands Unit::compile(bool rebuild) const
+inline sockaddr_un daemon_address()
 {
-    CompileCommands compile_commands;
-    compile_impl(compile_commands, target_type, rebuild, {});
-    return compile_commands;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, daemon_socket, sizeof(address.sun_path) - 1);
+    return address;
 }
 
-inline CompileCommands Unit::clean(bool remove_dir = false) const
+// Runs this invocation in the daemon and exits with its exit code. Returns, to build
+// locally, when no daemon runs, it runs another binary, or make's jobserver has to be
+// joined, which the daemon cannot do.
+inline void forward_to_daemon(int argc, char** argv)
 {
-    CompileCommands compile_commands;
-    if (!remove_dir)
+    for (int i = 1; i < argc; ++i)
     {
-        clean_impl(compile_commands);
+        if (std::strcmp(argv[i], "serve") == 0 ||
+            std::strcmp(argv[i], "nob_rebuild") == 0)
+        {
+            return;
+        }
     }
-    else
+    const char* makeflags = std::getenv("MAKEFLAGS");
+    DaemonRequest request;
+    if ((makeflags && std::strstr(makeflags, "--jobserver-")) || !identify_self(request))
     {
-        compile_commands.add_cmd(CompileCommand("rm", {"-r", "build"},
-                                                std::filesystem::exists("build"), false));
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un address = daemon_address();
+    if (fd == -1 ||
+        connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
     }
-    return compile_commands;
-}
-
-inline std::string Unit::get_target() const
-{
-    return *target_path;
-}
-
-inline std::ostream& operator<<(std::ostream& os, const Unit& unit)
-{
-    return os;
-}
 
-// ----------------------------------------------------------------------------------
-// Utils
-// ----------------------------------------------------------------------------------
+    request.argc = static_cast<uint32_t>(argc);
+    std::string message(reinterpret_cast<const char*>(&request), sizeof(request));
+    for (int i = 0; i < argc; ++i)
+    {
+        message.append(argv[i], std::strlen(argv[i]) + 1);
+    }
+    for (char** env = environ; *env != nullptr; ++env)
+    {
+        message.append(*env, std::strlen(*env) + 1);
+    }
 
-inline std::filesystem::path to_object_path(const std::filesystem::path& source)
-{
-    std::filesystem::path relative = source.lexically_relative("src");
-    std::filesystem::path obj_path = "build" / relative;
-    obj_path.replace_extension(".o");
-    return obj_path;
+    const int streams[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(streams))] = {};
+    iovec data{message.data(), message.size()};
+    msghdr header{};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(streams));
+    std::memcpy(CMSG_DATA(rights), streams, sizeof(streams));
+
+    std::cout.flush();
+    std::cerr.flush();
+    if (sendmsg(fd, &header, MSG_NOSIGNAL) == -1)
+    {
+        close(fd);
+        return;
+    }
+    DaemonReply reply;
+    ssize_t received;
+    do
+    {
+        received = recv(fd, &reply, sizeof(reply), 0);
+    } while (received == -1 && errno == EINTR);
+    close(fd);
+    if (received != sizeof(reply))
+    {
+        std::cerr << "nobcpp daemon went away" << std::endl;
+        std::exit(1);
+    }
+    if (reply.served)
+    {
+        std::exit(reply.exit_code);
+    }
 }
 
-inline std::vector<std::string> parse_dependency_file(
-    const std::filesystem::path& d_file_path)
+// Serves requests one at a time until interrupted, or until a request comes from
+// another binary or the source directories changed, as the trees would be stale.
+// Timestamps are not kept between requests, every build stats afresh.
+inline void Unit::serve(const std::unordered_map<std::string, Profile>& profiles)
 {
-    std::ifstream file(d_file_path);
-    if (!file)
+    DaemonRequest self;
+    if (!identify_self(self))
     {
-        throw std::runtime_error("Failed to open file: " + d_file_path.string());
+        perror("stat");
+        return;
     }
 
-    std::ostringstream oss;
-    std::string line;
-
-    // Handle line continuations with backslash
-    while (std::getline(file, line))
-    {
-        if (!line.empty() && line.back() == '\\')
+    // The socket file is remembered, so one removed by a request, e.g. cleanall, is
+    // created again, and one of another daemon is left alone
+    int listener = -1;
+    struct stat bound;
+    auto listen_on_socket = [&] {
+        if (listener != -1)
         {
-            line.pop_back(); // remove trailing backslash
-            oss << line;
+            close(listener);
         }
-        else
+        std::error_code ec;
+        std::filesystem::create_directories(
+            std::filesystem::path(daemon_socket).parent_path(), ec);
+        unlink(daemon_socket);
+        listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        sockaddr_un address = daemon_address();
+        if (listener == -1 ||
+            bind(listener, reinterpret_cast<const sockaddr*>(&address),
+                 sizeof(address)) == -1 ||
+            listen(listener, 16) == -1 || stat(daemon_socket, &bound) == -1)
         {
-            oss << line << ' '; // keep space for splitting
+            perror("nobcpp serve");
+            if (listener != -1)
+            {
+                close(listener);
+                listener = -1;
+            }
+            return false;
         }
+        return true;
+    };
+    auto socket_state = [&] {
+        struct stat info;
+        if (stat(daemon_socket, &info) == -1)
+        {
+            return errno == ENOENT ? 0 : -1; // 0: gone
+        }
+        return info.st_dev == bound.st_dev && info.st_ino == bound.st_ino ? 1 : -1;
+    };
+    // Before replying, so the client's next invocation finds the daemon again
+    auto keep_socket = [&] {
+        const int state = socket_state();
+        if (state == -1)
+        {
+            std::cout << daemon_socket << " was taken over, stopping the daemon"
+                      << std::endl;
+            return false;
+        }
+        return state == 1 || listen_on_socket();
+    };
+    if (!listen_on_socket())
+    {
+        return;
     }
 
-    std::istringstream dep_stream(oss.str());
-    std::string token;
+    sigset_t stop_signals, previous_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &previous_mask);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+
+    // Load what every request would otherwise start with: the forked children inherit
+    // the lowered graph, the deps log and the build log
+    deps_log();
+    lowered_graph(*this);
+    BuildLog{};
+    const std::vector<ListedDirectory> directories = listed_directories();
+
+    auto current = [&](const DaemonRequest& request) {
+        if (request.device != self.device || request.inode != self.inode ||
+            request.mtime_ns != self.mtime_ns)
+        {
+            std::cout << "nobcpp was rebuilt, stopping the daemon" << std::endl;
+            return false;
+        }
+        for (const auto& directory : directories)
+        {
+            std::error_code mtime_error;
+            auto mtime = std::filesystem::last_write_time(directory.path, mtime_error);
+            if ((mtime_error ? std::nullopt : std::optional(mtime)) != directory.mtime)
+            {
+                std::cout << directory.path << " changed, stopping the daemon"
+                          << std::endl;
+                return false;
+            }
+        }
+        return true;
+    };
 
-    std::vector<std::string> headers;
-    bool after_colon = false;
-    int cpp_seen = 0;
+    // Returns false once the daemon should stop
+    auto handle = [&](int connection) {
+        ssize_t size = recv(connection, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        if (size < static_cast<ssize_t>(sizeof(DaemonRequest)))
+        {
+            return true;
+        }
+        std::string message(static_cast<size_t>(size), '\0');
+        int streams[3];
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(streams))] = {};
+        iovec data{message.data(), message.size()};
+        msghdr header{};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if (recvmsg(connection, &header, MSG_CMSG_CLOEXEC) != size)
+        {
+            return true;
+        }
+        cmsghdr* rights = CMSG_FIRSTHDR(&header);
+        if (rights == nullptr || rights->cmsg_type != SCM_RIGHTS ||
+            rights->cmsg_len != CMSG_LEN(sizeof(streams)))
+        {
+            return true;
+        }
+        std::memcpy(streams, CMSG_DATA(rights), sizeof(streams));
 
-    while (dep_stream >> token)
-    {
-        if (!after_colon)
+        DaemonRequest request;
+        std::memcpy(&request, message.data(), sizeof(request));
+        std::vector<char*> strings;
+        if (message.back() == '\0')
         {
-            auto colon_pos = token.find(':');
-            if (colon_pos != std::string::npos)
+            for (size_t offset = sizeof(request); offset < message.size();
+                 offset = message.find('\0', offset) + 1)
             {
-                // Start reading dependencies after ':'
-                token = token.substr(colon_pos + 1);
-                after_colon = true;
-                if (token.empty())
-                    continue;
+                strings.push_back(message.data() + offset);
             }
-            else
+        }
+        DaemonReply reply;
+        const bool valid = request.argc != 0 && strings.size() >= request.argc;
+        if (!valid || !current(request))
+        {
+            for (int stream : streams)
             {
-                continue; // still in the target part
+                close(stream);
             }
+            send(connection, &reply, sizeof(reply), MSG_NOSIGNAL);
+            return !valid;
         }
 
-        // Skip the first non-target (assumed .cpp)
-        if (cpp_seen == 0 && token.ends_with(".cpp"))
+        std::cout.flush();
+        std::cerr.flush();
+        path_table().invalidate_all();
+        pid_t pid = fork();
+        if (pid == 0)
         {
-            cpp_seen++;
-            continue;
+            close(listener);
+            close(connection);
+            if (signal_fd != -1)
+            {
+                close(signal_fd);
+            }
+            sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
+            for (int i = 0; i < 3; ++i)
+            {
+                dup2(streams[i], i);
+                close(streams[i]);
+            }
+            clearenv();
+            for (size_t i = request.argc; i < strings.size(); ++i)
+            {
+                putenv(strings[i]);
+            }
+            std::vector<char*> args(strings.begin(), strings.begin() + request.argc);
+            args.push_back(nullptr);
+            parse(static_cast<int>(request.argc), args.data(), profiles);
+            std::exit(0);
+        }
+        for (int stream : streams)
+        {
+            close(stream);
+        }
+        if (pid == -1)
+        {
+            perror("fork");
+            return true;
         }
 
-        headers.push_back(token);
-    }
-
-    return headers;
-}
-
-inline std::unique_ptr<Unit> build_tree_from_cpp_files(
-    const std::filesystem::path& root_dir, const std::filesystem::path& target)
-{
-    auto root = std::make_unique<Unit>(std::nullopt, target.string(), root_dir.string());
+        // A client gone, e.g. by Ctrl-C, cancels its build
+        int pid_fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        bool hung_up = false;
+        while (pid_fd != -1)
+        {
+            pollfd fds[2] = {{pid_fd, POLLIN, 0},
+                             {hung_up ? -1 : connection, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1 && errno != EINTR)
+            {
+                break;
+            }
+            if (fds[0].revents != 0)
+            {
+                break;
+            }
+            if (fds[1].revents != 0)
+            {
+                kill(pid, SIGTERM);
+                hung_up = true;
+            }
+        }
+        if (pid_fd != -1)
+        {
+            close(pid_fd);
+        }
+        int status = 0;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        {
+        }
+        reply.served = 1;
+        reply.exit_code =
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        const bool keep_serving = keep_socket();
+        send(connection, &reply, sizeof(reply), MSG_NOSIGNAL);
+
+        // Catch up with what the build wrote, off the next request's path
+        deps_log().reload();
+        BuildLog{};
+        return keep_serving;
+    };
 
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(root_dir))
+    std::cout << "Serving builds on " << daemon_socket << std::endl;
+    while (true)
     {
-        if (entry.is_regular_file() && entry.path().extension() == ".cpp")
+        pollfd fds[2] = {{listener, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, signal_fd == -1 ? 1 : 2, -1) == -1)
         {
-            std::string src_path = entry.path().string();
-            std::filesystem::path obj_path = to_object_path(entry.path());
-
-            auto child = std::make_unique<Unit>(src_path, obj_path.string());
-            std::filesystem::path header_deps_path =
-                obj_path.parent_path().string() + "/" + obj_path.stem().string() + ".d";
-            if (std::filesystem::exists(header_deps_path))
+            if (errno == EINTR)
             {
-                const auto header_deps = parse_dependency_file(header_deps_path);
-                for (const auto& header_dep : header_deps)
-                {
-                    child->add_dep(std::make_unique<Unit>(header_dep));
-                }
+                continue;
+            }
+            break;
+        }
+        if (signal_fd != -1 && fds[1].revents != 0)
+        {
+            signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == -1)
+            {
+                perror("read");
             }
-            root->add_dep(std::move(child));
+            break;
+        }
+        int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection == -1)
+        {
+            continue;
+        }
+        const bool keep_serving = handle(connection);
+        close(connection);
+        if (!keep_serving)
+        {
+            break;
         }
     }
 
-    return root;
+    if (listener != -1)
+    {
+        close(listener);
+        if (socket_state() == 1)
+        {
+            unlink(daemon_socket);
+        }
+    }
+    if (signal_fd != -1)
+    {
+        close(signal_fd);
+    }
+    sigprocmask(SIG_SETMASK, &previous_mask, nullptr);
 }